@@ -0,0 +1,332 @@
+//
+// async_log.hpp
+// ~~~~~~~~~~~~~
+//
+// Leveled logging that never waits on the terminal or a pipe.
+//
+
+#ifndef ASYNC_LOG_HPP
+#define ASYNC_LOG_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <boost/utility/string_view.hpp>
+
+enum log_level { log_error, log_warn, log_info, log_debug, log_trace };
+
+// Lines above this level are compiled out of CHAT_LOG entirely.
+#ifndef CHAT_LOG_MAX_LEVEL
+#define CHAT_LOG_MAX_LEVEL log_trace
+#endif
+
+/*
+  The async_log class hands log lines to a background thread through a ring
+  of fixed size slots, so the thread that logs only copies the line and
+  never blocks. Producers claim slots with a compare and swap on [tail_]
+  (the bounded queue of Dmitry Vyukov, with one consumer); when the ring is
+  full the line is dropped and counted rather than waited for, and the
+  writer reports how many went missing.
+
+  The level is a relaxed atomic that can be changed while the server runs,
+  and CHAT_LOG tests it before building the line, so a disabled line costs
+  one load and a compare. Lines that happen for every message can be logged
+  with CHAT_LOG_SAMPLED, which only lets every [sample_every]th one through
+  on each thread.
+*/
+class async_log
+{
+public:
+  enum { max_line = 240 };
+  enum { default_capacity = 4096 };
+
+  // Logs to [out] through a ring of [capacity] slots, rounded up to a power
+  // of two.
+  explicit async_log(std::FILE* out, std::size_t capacity = default_capacity)
+    : out_(out),
+      level_(log_info),
+      sample_every_(1),
+      head_(0),
+      tail_(0),
+      dropped_(0),
+      stopping_(false)
+  {
+    std::size_t size = 2;
+    while (size < capacity)
+      size *= 2;
+    slots_.reset(new slot[size]);
+    mask_ = size - 1;
+    for (std::size_t i = 0; i < size; ++i)
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+    writer_ = std::thread([this](){ write_loop(); });
+  }
+
+  ~async_log()
+  {
+    stop();
+  }
+
+  // The logger of the process, writing to stdout.
+  static async_log& get()
+  {
+    static async_log log(stdout);
+    return log;
+  }
+
+  void set_level(log_level level)
+  {
+    level_.store(level, std::memory_order_relaxed);
+  }
+
+  log_level level() const
+  {
+    return static_cast<log_level>(level_.load(std::memory_order_relaxed));
+  }
+
+  bool enabled(log_level level) const
+  {
+    return level <= level_.load(std::memory_order_relaxed);
+  }
+
+  // Lets one in [every] sampled lines through, 1 for all of them.
+  void set_sample_every(unsigned int every)
+  {
+    sample_every_.store(every < 1 ? 1 : every, std::memory_order_relaxed);
+  }
+
+  unsigned int sample_every() const
+  {
+    return sample_every_.load(std::memory_order_relaxed);
+  }
+
+  bool sampled()
+  {
+    static thread_local unsigned int calls = 0;
+    unsigned int every = sample_every_.load(std::memory_order_relaxed);
+    return every <= 1 || ++calls % every == 0;
+  }
+
+  // Queues [length] bytes of [text] as one line at [level]. Returns false
+  // when the ring was full and the line was dropped.
+  bool push(log_level level, const char* text, std::size_t length)
+  {
+    std::size_t pos = tail_.load(std::memory_order_relaxed);
+    slot* s;
+    for (;;)
+    {
+      s = &slots_[pos & mask_];
+      std::size_t seq = s->seq.load(std::memory_order_acquire);
+      std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq - pos);
+      if (diff == 0)
+      {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else if (diff < 0)
+      {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      else
+      {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    s->level = level;
+    s->length = length < max_line ? length : std::size_t(max_line);
+    std::memcpy(s->text, text, s->length);
+    s->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Lines dropped because the ring was full, since the last report
+  std::size_t dropped() const
+  {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+  // Writes out everything queued so far and stops the writer thread. Lines
+  // logged after this are queued but never written.
+  void stop()
+  {
+    stopping_.store(true, std::memory_order_release);
+    if (writer_.joinable())
+      writer_.join();
+  }
+
+  static const char* level_name(log_level level)
+  {
+    static const char* names[] = { "ERROR", "WARN", "INFO", "DEBUG", "TRACE" };
+    return names[level];
+  }
+
+  // Parses "error", "warn", "info", "debug" or "trace" into [level].
+  static bool parse_level(boost::string_view name, log_level& level)
+  {
+    static const char* names[] = { "error", "warn", "info", "debug", "trace" };
+    for (int i = log_error; i <= log_trace; ++i)
+    {
+      if (name == names[i])
+      {
+        level = static_cast<log_level>(i);
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  struct slot
+  {
+    std::atomic<std::size_t> seq;
+    log_level level;
+    std::size_t length;
+    char text[max_line];
+  };
+
+  // Takes every line that is ready off the ring, writes them with one
+  // fwrite and flushes. Sleeps a little when there is nothing to do, so
+  // producers never have to wake it.
+  void write_loop()
+  {
+    std::string batch;
+    for (;;)
+    {
+      bool stopping = stopping_.load(std::memory_order_acquire);
+      for (;;)
+      {
+        slot& s = slots_[head_ & mask_];
+        if (s.seq.load(std::memory_order_acquire) != head_ + 1)
+          break;
+        batch += level_name(s.level);
+        batch += ": ";
+        batch.append(s.text, s.length);
+        batch += '\n';
+        s.seq.store(head_ + mask_ + 1, std::memory_order_release);
+        ++head_;
+      }
+      // counted after draining, so the report follows every line that was
+      // queued before the ones it stands for
+      std::size_t lost = dropped_.exchange(0, std::memory_order_relaxed);
+      if (lost > 0)
+        batch += "WARN: " + std::to_string(lost) + " log lines dropped\n";
+      if (!batch.empty())
+      {
+        std::fwrite(batch.data(), 1, batch.size(), out_);
+        std::fflush(out_);
+        batch.clear();
+      }
+      else if (stopping)
+      {
+        break;
+      }
+      else
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      }
+    }
+  }
+
+  std::FILE* out_;
+  std::atomic<int> level_;
+  std::atomic<unsigned int> sample_every_;
+  std::unique_ptr<slot[]> slots_;
+  std::size_t mask_;
+  // only the writer thread touches [head_]
+  std::size_t head_;
+  std::atomic<std::size_t> tail_;
+  std::atomic<std::size_t> dropped_;
+  std::atomic<bool> stopping_;
+  std::thread writer_;
+};
+
+/*
+  A log_line collects one line on the stack with << and queues it when it
+  goes out of scope at the end of the CHAT_LOG statement. Text past
+  async_log::max_line bytes is cut off.
+*/
+class log_line
+{
+public:
+  log_line(async_log& log, log_level level)
+    : log_(log),
+      level_(level),
+      length_(0)
+  {
+  }
+
+  ~log_line()
+  {
+    log_.push(level_, text_, length_);
+  }
+
+  log_line& operator<<(boost::string_view s)
+  {
+    std::size_t n = s.size();
+    if (n > async_log::max_line - length_)
+      n = async_log::max_line - length_;
+    std::memcpy(text_ + length_, s.data(), n);
+    length_ += n;
+    return *this;
+  }
+
+  log_line& operator<<(const std::string& s)
+  {
+    return *this << boost::string_view(s);
+  }
+
+  log_line& operator<<(const char* s)
+  {
+    return *this << boost::string_view(s);
+  }
+
+  log_line& operator<<(char c)
+  {
+    return *this << boost::string_view(&c, 1);
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value, log_line&>::type
+  operator<<(T value)
+  {
+    char digits[24];
+    int n = std::is_signed<T>::value
+      ? std::snprintf(digits, sizeof(digits), "%lld", static_cast<long long>(value))
+      : std::snprintf(digits, sizeof(digits), "%llu",
+          static_cast<unsigned long long>(value));
+    return *this << boost::string_view(digits, n);
+  }
+
+private:
+  log_line(const log_line&);
+  log_line& operator=(const log_line&);
+
+  async_log& log_;
+  log_level level_;
+  std::size_t length_;
+  char text_[async_log::max_line];
+};
+
+// CHAT_LOG(log_info) << "text " << 42; builds and queues the line only when
+// the level is enabled. CHAT_LOG_SAMPLED does the same for one in
+// sample_every() lines. The loop runs at most once; unlike an if/else it
+// is safe to use as the body of an if without braces.
+#define CHAT_LOG(level) \
+  for (bool chat_log_on = (level) <= CHAT_LOG_MAX_LEVEL \
+        && async_log::get().enabled(level); chat_log_on; chat_log_on = false) \
+    log_line(async_log::get(), (level))
+
+#define CHAT_LOG_SAMPLED(level) \
+  for (bool chat_log_on = (level) <= CHAT_LOG_MAX_LEVEL \
+        && async_log::get().enabled(level) && async_log::get().sampled(); \
+      chat_log_on; chat_log_on = false) \
+    log_line(async_log::get(), (level))
+
+#endif // ASYNC_LOG_HPP
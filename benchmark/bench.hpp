@@ -0,0 +1,58 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+/*
+  The time_benchmark function calls [fn] [iterations] times and returns the
+  average time per call in nanoseconds. [fn] returns a value that is folded
+  into a sink so the compiler cannot drop the work.
+*/
+template <typename Fn>
+double time_benchmark(std::size_t iterations, Fn& fn)
+{
+  static volatile std::size_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for(std::size_t i = 0; i < iterations; i++) {
+    sink = sink + fn();
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+/*
+  The run_benchmark function times [iterations] calls of [fn] after a short
+  warm up and prints the average time per call in nanoseconds under the
+  name [name]. Returns the nanoseconds per call.
+*/
+template <typename Fn>
+double run_benchmark(const std::string& name, std::size_t iterations, Fn fn)
+{
+  // warm up caches and branch predictors before timing
+  time_benchmark(iterations / 10 + 1, fn);
+  double ns = time_benchmark(iterations, fn);
+  std::cout << name << ": " << ns << " ns/op" << std::endl;
+  return ns;
+}
+
+/*
+  The measure_benchmark function picks the iteration count itself: it
+  doubles it until one run takes at least [min_ns] nanoseconds, then takes
+  the fastest of [repeats] runs of that many. The fastest run is the one
+  least disturbed by the rest of the machine, which keeps results from two
+  builds comparable. Returns the nanoseconds per call.
+*/
+template <typename Fn>
+double measure_benchmark(Fn fn, double min_ns = 20e6, int repeats = 3)
+{
+  std::size_t iterations = 1;
+  double ns = time_benchmark(iterations, fn);
+  while(ns * iterations < min_ns && iterations < (std::size_t(1) << 40)) {
+    iterations *= 2;
+    ns = time_benchmark(iterations, fn);
+  }
+  for(int i = 1; i < repeats; i++) {
+    ns = std::min(ns, time_benchmark(iterations, fn));
+  }
+  return ns;
+}
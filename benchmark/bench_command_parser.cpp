@@ -0,0 +1,71 @@
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "../util.hpp"
+#include "bench.hpp"
+
+/*
+  Compares the way chat_session used to split a received line into commands
+  (boost::split into strings, erase empties, compare against each command in
+  turn, rebuild the arguments) with parse_command and a table lookup.
+*/
+
+static const char* commands[] = {
+  "REQTEXT", "SENDTEXT", "REQUSERS", "REQCHATROOMS", "REQCHATROOM",
+  "CHANGECHATROOM", "NAMECHATROOM", "NICK", "REQUUID", "SUBSCRIBE",
+  "PROTOCOL", "MYUUID",
+};
+
+// the old way: split on ',' and ' ', erase empties, if-chain on strs[2]
+std::size_t split_dispatch(const std::string& read_line)
+{
+  std::vector<std::string> strs;
+  boost::split(strs, read_line, boost::is_any_of(", "));
+  for(unsigned int i = 0; i < strs.size(); i++) {
+    if(strs[i] == "") {
+      strs.erase(strs.begin()+i);
+    }
+  }
+  for(std::size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+    if(strs[2] == commands[i]) {
+      return i + build_optional_line(strs, 3).size();
+    }
+  }
+  return 0;
+}
+
+// the new way: one pass over the line, then a table lookup
+std::size_t parse_dispatch(boost::string_view read_line)
+{
+  command_line cmd;
+  if(!parse_command(read_line, cmd)) {
+    return 0;
+  }
+  for(std::size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+    if(cmd.command == commands[i]) {
+      return i + cmd.args.size();
+    }
+  }
+  return 0;
+}
+
+int main()
+{
+  std::string tm = "20171207T120000.123456";
+  std::vector<std::string> lines = {
+    "1a2b3c4d," + tm + ",REQTEXT",
+    "1a2b3c4d," + tm + ",SENDTEXT,the quick brown fox jumps over the lazy dog",
+    "1a2b3c4d," + tm + ",SENDTEXT," + std::string(400, 'x'),
+  };
+  const char* names[] = { "REQTEXT", "SENDTEXT 44B", "SENDTEXT 400B" };
+  for(std::size_t i = 0; i < lines.size(); i++) {
+    const std::string& line = lines[i];
+    double before = run_benchmark(std::string("split_dispatch ") + names[i], 200000,
+        [&line]() { return split_dispatch(line); });
+    double after = run_benchmark(std::string("parse_dispatch ") + names[i], 200000,
+        [&line]() { return parse_dispatch(line); });
+    std::cout << "speedup " << names[i] << ": " << before / after << "x" << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,47 @@
+#include <string>
+#include <iostream>
+
+#include "../util.hpp"
+#include "bench.hpp"
+
+/*
+  Compares the way replies used to be built (to_iso_string of the local
+  time, string concatenation, a stringstream for the checksum, then a copy
+  into a frame) with encode_request writing straight into the frame.
+*/
+
+// the old way: format the line as a string, then copy it into a frame
+chat_message_ptr string_reply(const std::string& command, const std::string& data)
+{
+  std::string tm = boost::posix_time::to_iso_string(boost::posix_time::microsec_clock::local_time());
+
+  std::string build = "," + tm + "," + command;
+  if(data != "") {
+    build += "," + data;
+  }
+  unsigned int chcksm = gen_checksum(build.data(), build.size());
+
+  std::stringstream sstream;
+  sstream << std::hex << chcksm << "";
+
+  return make_shared_message(sstream.str() + build);
+}
+
+int main()
+{
+  std::string uuid = gen_uuid();
+  std::string text = std::string(400, 'x');
+  const char* names[] = { "REQUUID", "REQTEXT 400B" };
+  const char* commands[] = { "REQUUID", "REQTEXT" };
+  const std::string* data[] = { &uuid, &text };
+  for(std::size_t i = 0; i < 2; i++) {
+    std::string command = commands[i];
+    const std::string& args = *data[i];
+    double before = run_benchmark(std::string("string_reply ") + names[i], 200000,
+        [&]() { return string_reply(command, args)->body_length(); });
+    double after = run_benchmark(std::string("encode_request ") + names[i], 200000,
+        [&]() { return make_request_message(command, args)->body_length(); });
+    std::cout << "speedup " << names[i] << ": " << before / after << "x" << std::endl;
+  }
+  return 0;
+}
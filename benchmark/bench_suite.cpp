@@ -0,0 +1,228 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../util.hpp"
+#include "bench.hpp"
+
+/*
+  Times the per-message hot path of util.hpp and chat_message.hpp across
+  message sizes from an empty argument to a full v1 body, and to large v2
+  bodies where the size matters. The results are printed as tab separated
+  lines
+
+    benchmark <tab> bytes <tab> ns_per_op <tab> mb_per_s
+
+  with a '#' header, so two runs can be diffed or kept as a baseline. Run
+  with -c <baseline> to compare against a saved run instead: every line
+  gets the baseline time and the change, and the exit status is 1 if
+  anything got slower by more than -x <percent> (10 by default).
+*/
+
+struct bench_result
+{
+  std::string name;
+  std::size_t bytes;
+  double ns;
+};
+
+// Runs the benchmarks whose name contains [filter] and collects their results
+struct bench_suite
+{
+  std::string filter;
+  std::vector<bench_result> results;
+
+  template <typename Fn>
+  void run(const std::string& name, std::size_t bytes, Fn fn)
+  {
+    if(filter.empty() || name.find(filter) != std::string::npos)
+      results.push_back({ name, bytes, measure_benchmark(fn) });
+  }
+};
+
+// A line of text [n] bytes long made of words, the way chat messages look
+std::string message_text(std::size_t n)
+{
+  std::string text;
+  static const char* words[] = { "the", "quick", "brown", "fox", "jumps",
+    "over", "lazy", "dog" };
+  for(std::size_t i = 0; text.size() < n; i++) {
+    if(!text.empty())
+      text += ' ';
+    text += words[i % 8];
+  }
+  text.resize(n);
+  return text;
+}
+
+void run_suite(bench_suite& bench)
+{
+  const std::size_t v1_sizes[] = { 0, 16, 64, 256, 440 };
+  const std::size_t v2_sizes[] = { 64, 4096, 65536 };
+
+  for(std::size_t n: v1_sizes) {
+    std::string text = message_text(n);
+    std::string line = format_request("SENDTEXT", text);
+    std::vector<std::string> words;
+    boost::split(words, text, boost::is_any_of(" "));
+    chat_message msg;
+
+    bench.run("format_request", n, [&]() { return format_request("SENDTEXT", text).size(); });
+    bench.run("encode_request.crc32", n, [&]()
+        {
+          encode_request(msg, "SENDTEXT", text);
+          return msg.body_length();
+        });
+    bench.run("encode_request.crc32c", n, [&]()
+        {
+          encode_request(msg, "SENDTEXT", text, checksum_crc32c);
+          return msg.body_length();
+        });
+    bench.run("checkCheckSum", n, [&]() { return std::size_t(checkCheckSum(line)); });
+    bench.run("gen_crc32", n, [&]() { return std::size_t(gen_crc32(line)); });
+    bench.run("build_optional_line", n, [&]() { return build_optional_line(words, 0).size(); });
+    bench.run("parse_command", n, [&]()
+        {
+          command_line cmd;
+          parse_command(line, cmd);
+          return cmd.args.size();
+        });
+  }
+
+  for(std::size_t n: v2_sizes) {
+    std::string text = message_text(n);
+    std::string line = format_request("SENDTEXT", text);
+    bench.run("verify_checksum.crc32", n, [&]()
+        {
+          return std::size_t(verify_checksum(line.data(), line.size()));
+        });
+    bench.run("verify_checksum.crc32c", n, [&]()
+        {
+          return std::size_t(verify_checksum(line.data(), line.size(), checksum_crc32c));
+        });
+  }
+
+  // Header coding only depends on the size through the length field and
+  // the body resize, so v1 and v2 are timed at a few sizes each.
+  for(std::size_t n: v1_sizes) {
+    chat_message msg;
+    msg.body_length(n);
+    bench.run("encode_header.v1", n, [&]()
+        {
+          msg.encode_header();
+          return std::size_t(msg.data()[3]);
+        });
+    msg.encode_header();
+    char header[chat_message::header_length];
+    std::memcpy(header, msg.data(), sizeof(header));
+    chat_message in;
+    bench.run("decode_header.v1", n, [&]()
+        {
+          std::memcpy(in.header_buffer(), header, sizeof(header));
+          return std::size_t(in.decode_header()) + in.body_length();
+        });
+  }
+  for(std::size_t n: v2_sizes) {
+    chat_message msg;
+    msg.body_length(n);
+    msg.encode_header();
+    std::string header(msg.v2_header(), msg.v2_header_length());
+    chat_message in;
+    bench.run("decode_header.v2", n, [&]()
+        {
+          std::memcpy(in.header_buffer(), header.data(), header.size());
+          return std::size_t(in.decode_header(header.size())) + in.body_length();
+        });
+  }
+
+  bench.run("gen_uuid", 36, []() { return gen_uuid().size(); });
+}
+
+// Reads a saved run into [baseline], keyed by "name bytes".
+bool read_baseline(const char* path, std::map<std::string, double>& baseline)
+{
+  std::ifstream in(path);
+  if(!in) {
+    return false;
+  }
+  std::string line;
+  while(std::getline(in, line)) {
+    if(line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream fields(line);
+    std::string name, bytes;
+    double ns;
+    if(std::getline(fields, name, '\t') && std::getline(fields, bytes, '\t')
+        && fields >> ns) {
+      baseline[name + " " + bytes] = ns;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char* argv[])
+{
+  // Options:
+  //   -f <text>      only run the benchmarks whose name contains <text>
+  //   -c <file>      compare against a run saved in <file>
+  //   -x <percent>   how much slower counts as a regression, 10 by default
+  bench_suite suite;
+  const char* baseline_path = NULL;
+  double threshold = 10;
+  for(int i = 1; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    if(flag == "-f") {
+      suite.filter = argv[i + 1];
+    } else if(flag == "-c") {
+      baseline_path = argv[i + 1];
+    } else if(flag == "-x") {
+      threshold = std::atof(argv[i + 1]);
+    } else {
+      std::cerr << "Usage: bench_suite [-f <text>] [-c <baseline>] [-x <percent>]\n";
+      return 2;
+    }
+  }
+  std::map<std::string, double> baseline;
+  if(baseline_path && !read_baseline(baseline_path, baseline)) {
+    std::cerr << "bench_suite: cannot read " << baseline_path << std::endl;
+    return 2;
+  }
+
+  run_suite(suite);
+  int regressions = 0;
+  if(!baseline_path) {
+    std::printf("# benchmark\tbytes\tns_per_op\tmb_per_s\n");
+  } else {
+    std::printf("# benchmark\tbytes\tns_per_op\tbaseline_ns\tchange_pct\n");
+  }
+  for(const bench_result& r: suite.results) {
+    if(!baseline_path) {
+      std::printf("%s\t%zu\t%.2f\t%.1f\n", r.name.c_str(), r.bytes, r.ns,
+          r.bytes * 1e3 / r.ns);
+      continue;
+    }
+    auto found = baseline.find(r.name + " " + std::to_string(r.bytes));
+    if(found == baseline.end()) {
+      std::printf("%s\t%zu\t%.2f\t-\t-\n", r.name.c_str(), r.bytes, r.ns);
+      continue;
+    }
+    double change = (r.ns - found->second) / found->second * 100;
+    bool regressed = change > threshold;
+    regressions += regressed;
+    std::printf("%s\t%zu\t%.2f\t%.2f\t%+.1f%s\n", r.name.c_str(), r.bytes, r.ns,
+        found->second, change, regressed ? "\tREGRESSION" : "");
+  }
+  if(regressions > 0) {
+    std::fprintf(stderr, "%d benchmarks more than %g%% slower\n", regressions,
+        threshold);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,31 @@
+#include <string>
+#include <iostream>
+
+#include "../util.hpp"
+#include "bench.hpp"
+
+/*
+  Compares the way REQUUID used to make a uuid (a new boost
+  random_generator per call) with gen_uuid and its per-thread pool. Every
+  connecting client asks for one, so uuids per second is an upper bound
+  on connects per second; the connect itself is not measured here.
+*/
+
+// the old way: construct and seed a generator for every uuid
+std::string fresh_generator_uuid()
+{
+  boost::uuids::uuid uuid = boost::uuids::random_generator()();
+  return boost::uuids::to_string(uuid);
+}
+
+int main()
+{
+  double before = run_benchmark("fresh_generator_uuid", 100000,
+      []() { return fresh_generator_uuid().size(); });
+  double after = run_benchmark("gen_uuid", 100000,
+      []() { return gen_uuid().size(); });
+  std::cout << "uuid/s fresh_generator_uuid: " << 1e9 / before << std::endl;
+  std::cout << "uuid/s gen_uuid: " << 1e9 / after << std::endl;
+  std::cout << "speedup: " << before / after << "x" << std::endl;
+  return 0;
+}
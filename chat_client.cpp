@@ -1,7 +1,9 @@
+#include <algorithm>
 #include <cstdlib>
 #include <deque>
 #include <iostream>
 #include <thread>
+#include <atomic>
 #include <iomanip>
 #include <boost/asio.hpp>
 #include <boost/algorithm/string.hpp>
@@ -18,178 +20,55 @@
 #include <FL/Fl_Text_Display.H>
 #include <FL/Fl_Menu_Bar.H>
 
-#include "util.hpp"
+#include "chat_connection.hpp"
+#include "spsc_queue.hpp"
 
 
 using boost::asio::ip::tcp;
 
-// the queue of messages to be sent by the client
-typedef std::deque<chat_message> chat_message_queue;
-
 // a lock to ensure thread safety
 boost::mutex data_lock;
 
-// global strings to store the lists of chat users and chat rooms that is
-// received by the server
-std::string users, rooms;
+// global lists of the chat users and chat rooms that are received from the
+// server
+std::vector<chat_user> users;
+std::vector<std::string> rooms;
 
 // declaring some fltk callbacks so that they can be used before being defined
-// the cb_recv function has a string parameter [S] and is called when a message
-// is received by the server so that it can be appeneded to the GUI
+// the cb_recv function has a string parameter [S] and is called on the
+// io_service thread when a message is received by the server so that it can
+// be appeneded to the GUI
 static void cb_recv (std::string S);
 // the change_room function takes a string [S] as a parameter and changes the chat
-// room that the user is currently in.
+// room that the user is currently in. It is also called on the io_service
+// thread.
 static void change_room (std::string S);
 
+// ------------------UI UPDATES------------------
 /*
-  Chat client is where message encoding and decoding will occur. It will
-  be where messages received from the server are processed and handled.
+  FLTK may only be touched from the thread that runs Fl::run, so cb_recv and
+  change_room do not change the window themselves. They queue a ui_update
+  for the UI thread and wake it with Fl::awake, at most once until it has
+  caught up; drain_ui then appends everything that came in since with one
+  append and one redraw, however busy the room is.
 */
-class chat_client
+struct ui_update
 {
-public:
-  chat_client(boost::asio::io_service& io_service,
-      tcp::resolver::iterator endpoint_iterator, void (*data_recv) (std::string S))
-    : io_service_(io_service),
-      socket_(io_service), data_recv_ (data_recv)
-  {
-    do_connect(endpoint_iterator);
-  }
-
-  void write(const chat_message& msg)
-  {
-    io_service_.post(
-        [this, msg]()
-        {
-          bool write_in_progress = !write_msgs_.empty();
-          write_msgs_.push_back(msg);
-          if (!write_in_progress)
-          {
-            do_write();
-          }
-        });
-  }
-
-  void close()
-  {
-    io_service_.post([this]() { socket_.close(); });
-  }
-
-private:
-  void do_connect(tcp::resolver::iterator endpoint_iterator)
-  {
-    boost::asio::async_connect(socket_, endpoint_iterator,
-        [this](boost::system::error_code ec, tcp::resolver::iterator)
-        {
-          if (!ec)
-          {
-            do_read_header();
-          }
-        });
-  }
-
-  void do_read_header()
-  {
-    boost::asio::async_read(socket_,
-        boost::asio::buffer(read_msg_.data(), chat_message::header_length),
-        [this](boost::system::error_code ec, std::size_t /*length*/)
-        {
-          if (!ec && read_msg_.decode_header())
-          {
-            do_read_body();
-          }
-          else
-          {
-            socket_.close();
-          }
-        });
-  }
-
-  void do_read_body()
-  {
-    boost::asio::async_read(socket_,
-        boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
-        [this](boost::system::error_code ec, std::size_t /*length*/)
-        {
-          if (!ec)
-          {
-            //
-            std::string read_line = std::string(read_msg_.body()).substr(0, read_msg_.body_length());
-            //std::cout << read_line <<" <------\n";
-            if(checkCheckSum(read_line.c_str())) {
-              std::vector<std::string> strs;
-              boost::split(strs, read_line, boost::is_any_of(", "));
-              for(unsigned int i = 0; i < strs.size(); i++) {
-                if(strs[i] == "") {
-                  strs.erase(strs.begin()+i);
-                }
-              }
-              if(strs[2] == "REQTEXT" && strs.size() > 3) {
-                std::vector<std::string> messages;
-                std::string mess = read_line.substr(read_line.find("REQTEXT,")+8, read_line.length());
-                boost::split(messages, mess, boost::is_any_of(";"));
-                //std::cout << mess <<" <------\n";
-                for(unsigned int i = 0; i < messages.size()-1; i++) {
-                  std::string s = messages[i].substr(messages[i].find(" ")+1, messages[i].length());
-                  //std::cout << s <<" <------\n";
-                  data_recv_(s);
-                  data_recv_("\n");
-                }
-              } else if(strs[2] == "CHANGECHATROOM" && strs.size() > 3) {
-                std::string m = build_optional_line(strs, 3);
-                change_room(m);
-              } else if(strs[2] == "REQUSERS" && strs.size() > 3) {
-                data_lock.lock();
-                users = read_line.substr(read_line.find("REQUSERS,")+9, read_line.length());
-                data_lock.unlock ();
-              } else if(strs[2] == "REQCHATROOMS") {
-                data_lock.lock();
-                rooms = read_line.substr(read_line.find("REQCHATROOMS,")+13, read_line.length());
-                data_lock.unlock();
-              }
-            }
-            std::cout.write(read_msg_.body(), read_msg_.body_length());
-            std::cout << "\n";
-            do_read_header();
-          }
-          else
-          {
-            socket_.close();
-          }
-        });
-  }
-
-  void do_write()
-  {
-    boost::asio::async_write(socket_,
-        boost::asio::buffer(write_msgs_.front().data(),
-          write_msgs_.front().length()),
-        [this](boost::system::error_code ec, std::size_t /*length*/)
-        {
-          if (!ec)
-          {
-            write_msgs_.pop_front();
-            if (!write_msgs_.empty())
-            {
-              do_write();
-            }
-          }
-          else
-          {
-            socket_.close();
-          }
-        });
-  }
-
-private:
-  boost::asio::io_service& io_service_;
-  tcp::socket socket_;
-  void (*data_recv_)(std::string S);
-  chat_message read_msg_;
-  chat_message_queue write_msgs_;
+  // clear the messages for the room [text] instead of appending [text]
+  bool room = false;
+  std::string text;
 };
-// pointer to a chat_client [c]
-chat_client *c = NULL;
+// written only by the io_service thread and read only by the UI thread
+spsc_queue<ui_update> ui_updates(4096);
+// set while a drain_ui is on its way, so each batch costs one Fl::awake
+std::atomic<bool> ui_wake_pending(false);
+// messages that did not fit in [ui_updates], reported in their place
+std::atomic<std::size_t> ui_dropped(0);
+// the most text kept in the message window, older lines are removed
+const int max_scrollback = 256 * 1024;
+
+// the connection to the server [c]
+chat_connection_ptr c;
 //pointer to a new thread [t]
 std::thread *t = NULL;
 //pointer to the thread that will be used for polling [t_polling]
@@ -259,14 +138,8 @@ class Change_nick {
 // creating an instance [change_nick] of the nick name dialog box
 Change_nick *change_nick = new Change_nick;
 void enter_nick() {
-  chat_message msg;
-  char req[chat_message::max_body_length + 1];
   std::string s = change_nick->get_input();
-  strcpy(req, format_request("NICK", s).c_str());
-  msg.body_length(std::strlen(req));
-  std::memcpy(msg.body(), req, msg.body_length());
-  msg.encode_header();
-  c->write(msg);
+  c->set_nick(s);
   change_nick->clear();
   change_nick->hide();
 
@@ -316,14 +189,8 @@ class Add_room {
 };
 Add_room *add_room = new Add_room;
 void enter_newroom() {
-  chat_message msg;
-  char req[chat_message::max_body_length + 1];
   std::string s = add_room->get_input();
-  strcpy(req, format_request("NAMECHATROOM", s).c_str());
-  msg.body_length(std::strlen(req));
-  std::memcpy(msg.body(), req, msg.body_length());
-  msg.encode_header();
-  c->write(msg);
+  c->create_room(s);
   add_room->clear();
   add_room->hide();
 }
@@ -371,14 +238,8 @@ class Join_room {
 };
 Join_room *join_room = new Join_room;
 void enter_joinroom() {
-  chat_message msg;
-  char req[chat_message::max_body_length + 1];
   std::string s = join_room->get_input();
-  strcpy(req, format_request("CHANGECHATROOM", s).c_str());
-  msg.body_length(std::strlen(req));
-  std::memcpy(msg.body(), req, msg.body_length());
-  msg.encode_header();
-  c->write(msg);
+  c->change_room(s);
   join_room->clear();
 
   join_room->hide();
@@ -394,44 +255,30 @@ void open_joinroom() { //Fl_Widget* w, void* p
 
 // ------------------LISTUSERS-------------------
 void request_listusers() {
-  chat_message msg;
-  char req[chat_message::max_body_length + 1];
-  std::string s = add_room->get_input();
-  strcpy(req, format_request("REQUSERS", "").c_str());
-  msg.body_length(std::strlen(req));
-  std::memcpy(msg.body(), req, msg.body_length());
-  msg.encode_header();
-  c->write(msg);
+  c->request_users();
 }
 void list_users() {
-  std::vector<std::string> messages;
-  boost::split(messages, users, boost::is_any_of(",;"));
   std::string output;
-  for(unsigned int i = 0; i < messages.size()-1; i+=2) {
-    output += std::to_string(i)+".\t("+messages[i].substr(0, 7)+") Name: "+messages[i+1]+"\n";
+  data_lock.lock();
+  for(unsigned int i = 0; i < users.size(); i++) {
+    output += std::to_string(i)+".\t("+users[i].uuid.substr(0, 7)+") Name: "+users[i].name+"\n";
   }
+  data_lock.unlock();
   fl_message(output.c_str());
 }
 // ------------------LISTUSERS-------------------
 
 // ------------------LISTROOMS-------------------
 void request_listrooms() {
-  chat_message msg;
-  char req[chat_message::max_body_length + 1];
-  std::string s = add_room->get_input();
-  strcpy(req, format_request("REQCHATROOMS", "").c_str());
-  msg.body_length(std::strlen(req));
-  std::memcpy(msg.body(), req, msg.body_length());
-  msg.encode_header();
-  c->write(msg);
+  c->request_rooms();
 }
 void list_rooms() {
-  std::vector<std::string> messages;
-  boost::split(messages, rooms, boost::is_any_of(";"));
   std::string output;
-  for(unsigned int i = 0; i < messages.size()-1; i++) {
-    output += std::to_string(i)+".\t"+messages[i]+"\n";
+  data_lock.lock();
+  for(unsigned int i = 0; i < rooms.size(); i++) {
+    output += std::to_string(i)+".\t"+rooms[i]+"\n";
   }
+  data_lock.unlock();
   fl_message(output.c_str());
 }
 // ------------------LISTROOMS-------------------
@@ -476,28 +323,71 @@ Fl_Text_Buffer *buff = new Fl_Text_Buffer ();
 
 Fl_Text_Display *disp = new Fl_Text_Display (10,80,800,400);
 // -----------------MAIN WINDOW------------------
-static void change_room (std::string S) {
-  currentRoom->value(S.c_str());
+// the show_room function shows the empty chat room [room], on the UI thread
+static void show_room (const std::string& room) {
+  currentRoom->value(room.c_str());
   buff->text("");
 }
-static void cb_recv (std::string S)
+
+// the drain_ui function runs on the UI thread and applies the queued updates
+static void drain_ui (void*)
 {
-  // Note, this is an async callback from the perspective
-  // of Fltk..
-  //
-  // high chance of a lock needed here if certain fltk calls
-  // are made.  (like show() .... )
-  std::string T = S;// + '\0';
-  if (buff)
-  {
-    buff->append ( T.c_str () );
+  // cleared first, so updates queued from here on wake us again
+  ui_wake_pending = false;
+  std::string batch;
+  ui_update update;
+  while (ui_updates.pop(update)) {
+    if (update.room) {
+      // text for the room we left goes with it
+      show_room(update.text);
+      batch.clear();
+    } else {
+      batch += update.text;
+    }
   }
-  if (disp)
-  {
-    disp->show ();
+  std::size_t dropped = ui_dropped.exchange(0);
+  if (dropped > 0) {
+    batch += "[" + std::to_string(dropped) + " messages not shown]\n";
   }
+  if (batch.empty()) {
+    return;
+  }
+  buff->append(batch.c_str());
+  if (buff->length() > max_scrollback) {
+    // cut whole lines off the front
+    int cut = buff->line_end(buff->length() - max_scrollback) + 1;
+    buff->remove(0, std::min(cut, buff->length()));
+  }
+}
 
-  win.show ();
+static void wake_ui ()
+{
+  if (!ui_wake_pending.exchange(true) && Fl::awake(drain_ui) != 0) {
+    // FLTK's own queue was full; try again with the next update
+    ui_wake_pending = false;
+  }
+}
+
+static void change_room (std::string S) {
+  ui_update update;
+  update.room = true;
+  update.text = S;
+  // a room change is never dropped, the UI thread is draining anyway
+  while (!ui_updates.push(update)) {
+    wake_ui();
+    std::this_thread::yield();
+  }
+  wake_ui();
+}
+
+static void cb_recv (std::string S)
+{
+  ui_update update;
+  update.text = S;
+  if (!ui_updates.push(update)) {
+    ui_dropped++;
+  }
+  wake_ui();
 }
 
 static void cb_msg (Fl_Input*)
@@ -505,13 +395,7 @@ static void cb_msg (Fl_Input*)
   if(std::string(input1.value()) != ""
     && std::string(input1.value()).find(",") == std::string::npos
     && std::string(input1.value()).find(";") == std::string::npos) {
-    chat_message msg;
-    char req[chat_message::max_body_length + 1];
-    strcpy(req, format_request("SENDTEXT", input1.value()).c_str());
-    msg.body_length(std::strlen(req));
-    std::memcpy(msg.body(), req, msg.body_length());
-    msg.encode_header();
-    c->write(msg);
+    c->send_text(input1.value());
     input1.value("");
   } else {
     //TODO : Warning message here
@@ -521,16 +405,11 @@ static void cb_msg (Fl_Input*)
 void poll() {
   usleep(1000000);
     while(polling) {
-      chat_message msg;
-      char req[chat_message::max_body_length + 1];
-      strcpy(req, format_request("REQTEXT", "").c_str());
-      msg.body_length(std::strlen(req));
-      std::memcpy(msg.body(), req, msg.body_length());
-      msg.encode_header();
-      c->write(msg);
+      // Servers that do not know SUBSCRIBE never acknowledge it, so old
+      // servers are still polled for new text.
+      c->request_text();
       request_listrooms();
       request_listusers();
-      Fl::check();
       usleep(400000);
     }
 }
@@ -547,21 +426,49 @@ int main(int argc, char* argv[])
 
     boost::asio::io_service io_service;
 
+    // The connection reports what the server says through these, from the
+    // io_service thread.
+    chat_events events;
+    events.on_message = [](const std::string&, const std::string& text)
+    {
+      cb_recv(text + "\n");
+    };
+    events.on_missed = [](std::size_t count)
+    {
+      cb_recv("[" + std::to_string(count) + " messages missed]\n");
+    };
+    events.on_room_changed = [](const std::string& room) { change_room(room); };
+    events.on_users = [](const std::vector<chat_user>& list)
+    {
+      data_lock.lock();
+      users = list;
+      data_lock.unlock();
+    };
+    events.on_rooms = [](const std::vector<std::string>& list)
+    {
+      data_lock.lock();
+      rooms = list;
+      data_lock.unlock();
+    };
+    events.on_line = [](boost::string_view line)
+    {
+      std::cout << line << "\n";
+    };
+
     tcp::resolver resolver(io_service);
     auto endpoint_iterator = resolver.resolve({ argv[1], argv[2] });
-    c = new chat_client(io_service, endpoint_iterator, &cb_recv);
-
+    // Once connected it asks for a uuid, the v2 framing with compressed
+    // history, CRC32C where the CPU has it, and for messages to be pushed.
+    c = std::make_shared<chat_connection>(io_service, events);
+    c->connect(endpoint_iterator);
+
+    // lets the io_service thread wake the UI with Fl::awake; FLTK needs this
+    // before any other thread can call it
+    Fl::lock();
     t = new std::thread([&io_service](){ io_service.run(); });
     t_polling = new std::thread(static_cast<void(*)()>(poll));
 
-    change_room("the lobby");
-    chat_message uuid_req;
-    char req[chat_message::max_body_length + 1];
-    strcpy(req, format_request("REQUUID", "").c_str());
-    uuid_req.body_length(std::strlen(req));
-    std::memcpy(uuid_req.body(), req, uuid_req.body_length());
-    uuid_req.encode_header();
-    c->write(uuid_req);
+    show_room("the lobby");
     currentRoom->align(FL_ALIGN_LEFT);
     win.begin ();
     win.add (input1);
@@ -0,0 +1,664 @@
+//
+// chat_connection.hpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Headless client side of the chat protocol, for the GUI, bots and tools.
+//
+
+#ifndef CHAT_CONNECTION_HPP
+#define CHAT_CONNECTION_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/utility/string_view.hpp>
+
+#include "chat_message.hpp"
+#include "frame_deflate.hpp"
+#include "util.hpp"
+
+/*
+  A user in a REQUSERS or USERSDELTA reply
+*/
+struct chat_user
+{
+  std::string uuid;
+  std::string name;
+};
+
+/*
+  The callbacks a chat_connection reports what the server says through.
+  Any of them may be left empty. They run on the connection's strand, one
+  at a time per connection, but connections sharing an io_service run
+  theirs in parallel when it has several threads.
+*/
+struct chat_events
+{
+  // the server gave us [uuid] in reply to REQUUID
+  std::function<void(const std::string& uuid)> on_uuid;
+  // a message [text] sent to our room by the user [sender] (a uuid)
+  std::function<void(const std::string& sender, const std::string& text)> on_message;
+  // we are now in [room]
+  std::function<void(const std::string& room)> on_room_changed;
+  // the users of our room and every room on the server
+  std::function<void(const std::vector<chat_user>& users)> on_users;
+  std::function<void(const std::vector<std::string>& rooms)> on_rooms;
+  // the nickname the server gave us, which may differ from the one asked for
+  std::function<void(const std::string& name)> on_nick;
+  // we fell behind and the server dropped [count] messages meant for us
+  std::function<void(std::size_t count)> on_missed;
+  // every line received, checked or not, before it is handled
+  std::function<void(boost::string_view line)> on_line;
+  // the connection failed or was closed
+  std::function<void(const boost::system::error_code& ec)> on_closed;
+};
+
+/*
+  What a chat_connection asks the server for once it is connected. Servers
+  that do not know a request ignore it and the connection keeps working
+  the old way.
+*/
+struct chat_connection_options
+{
+  // ask for a uuid with REQUUID
+  bool request_uuid = true;
+  // the v2 framing, and history replay in deflate batches on top of it
+  bool v2 = true;
+  bool compress = true;
+  // CRC32C checksums when the CPU computes them in hardware
+  bool crc32c = true;
+  // new messages pushed with SUBSCRIBE instead of polled for with REQTEXT
+  bool subscribe = true;
+};
+
+/*
+  The page of a REQTEXT reply, "<uuid> <text>;" per message, optionally
+  followed by "+<token>" when more are waiting. Calls [on_message] for
+  every message and returns the token, empty if there is none.
+*/
+template <typename Handler>
+boost::string_view parse_reqtext_page(boost::string_view page, Handler on_message)
+{
+  std::size_t start = 0;
+  std::size_t end;
+  while ((end = page.find(';', start)) != boost::string_view::npos)
+  {
+    boost::string_view entry = page.substr(start, end - start);
+    std::size_t space = entry.find(' ');
+    if (space == boost::string_view::npos)
+      on_message(boost::string_view(), entry);
+    else
+      on_message(entry.substr(0, space), entry.substr(space + 1));
+    start = end + 1;
+  }
+  if (start < page.size() && page[start] == '+')
+    return page.substr(start + 1);
+  return boost::string_view();
+}
+
+// The users of a REQUSERS reply, "<uuid>,<name>;" each
+inline std::vector<chat_user> parse_user_list(boost::string_view list)
+{
+  std::vector<chat_user> users;
+  std::size_t start = 0;
+  std::size_t end;
+  while ((end = list.find(';', start)) != boost::string_view::npos)
+  {
+    boost::string_view entry = list.substr(start, end - start);
+    std::size_t comma = entry.find(',');
+    chat_user user;
+    user.uuid = std::string(entry.substr(0, comma));
+    if (comma != boost::string_view::npos)
+      user.name = std::string(entry.substr(comma + 1));
+    users.push_back(user);
+    start = end + 1;
+  }
+  return users;
+}
+
+// The rooms of a REQCHATROOMS reply, "<name>;" each
+inline std::vector<std::string> parse_room_list(boost::string_view list)
+{
+  std::vector<std::string> rooms;
+  std::size_t start = 0;
+  std::size_t end;
+  while ((end = list.find(';', start)) != boost::string_view::npos)
+  {
+    rooms.push_back(std::string(list.substr(start, end - start)));
+    start = end + 1;
+  }
+  return rooms;
+}
+
+// Splits a USERSDELTA or ROOMSDELTA reply "<token>,<entries>" into its
+// token and entries.
+inline boost::string_view split_delta(boost::string_view reply,
+    boost::string_view& entries)
+{
+  std::size_t comma = reply.find(',');
+  if (comma == boost::string_view::npos)
+  {
+    entries = boost::string_view();
+    return reply;
+  }
+  entries = reply.substr(comma + 1);
+  return reply.substr(0, comma);
+}
+
+// Applies the entries of a USERSDELTA reply to [members], keyed by the
+// server's session number: "=;" forgets everyone, "+<session>,<uuid>,<name>;"
+// adds or updates a user and "-<session>;" removes one.
+inline void apply_user_delta(boost::string_view entries,
+    std::map<unsigned long, chat_user>& members)
+{
+  std::size_t start = 0;
+  std::size_t end;
+  while ((end = entries.find(';', start)) != boost::string_view::npos)
+  {
+    boost::string_view entry = entries.substr(start, end - start);
+    start = end + 1;
+    if (entry.empty())
+      continue;
+    if (entry[0] == '=')
+    {
+      members.clear();
+      continue;
+    }
+    std::size_t comma = entry.find(',');
+    boost::string_view session = comma == boost::string_view::npos
+      ? entry.substr(1) : entry.substr(1, comma - 1);
+    unsigned long id = std::strtoul(std::string(session).c_str(), NULL, 10);
+    if (entry[0] == '-')
+    {
+      members.erase(id);
+    }
+    else if (entry[0] == '+' && comma != boost::string_view::npos)
+    {
+      boost::string_view rest = entry.substr(comma + 1);
+      std::size_t name = rest.find(',');
+      chat_user& user = members[id];
+      user.uuid = std::string(rest.substr(0, name));
+      user.name = name == boost::string_view::npos
+        ? std::string() : std::string(rest.substr(name + 1));
+    }
+  }
+}
+
+// Applies the entries of a ROOMSDELTA reply to [rooms]: "=;" forgets them
+// all and "+<name>;" adds a room.
+inline void apply_room_delta(boost::string_view entries,
+    std::vector<std::string>& rooms)
+{
+  std::size_t start = 0;
+  std::size_t end;
+  while ((end = entries.find(';', start)) != boost::string_view::npos)
+  {
+    boost::string_view entry = entries.substr(start, end - start);
+    start = end + 1;
+    if (entry == "=")
+      rooms.clear();
+    else if (!entry.empty() && entry[0] == '+')
+      rooms.push_back(std::string(entry.substr(1)));
+  }
+}
+
+/*
+  The chat_connection class is one client connection to a chat server. It
+  negotiates the options in chat_connection_options, turns the replies
+  into chat_events, and follows REQTEXT pages to the end of the backlog by
+  itself.
+
+  The user and room lists are kept up to date with USERSDELTA and
+  ROOMSDELTA, which only send what changed since the version the last
+  reply carried, and nothing when nothing did. Until the server answers
+  one of those the plain REQUSERS and REQCHATROOMS are sent along, for
+  servers that do not know them; either way on_users and on_rooms get the
+  whole list.
+
+  Requests can be made from any thread. They are encoded in order on the
+  connection's strand with the checksum in effect at that point, queued,
+  and written back to back without waiting for replies, as many as fit in
+  one gather write. Requests made before the connection is up wait in the
+  queue. Everything runs on the io_service given to the constructor, so
+  one io_service (and one or a few threads) can carry thousands of
+  connections.
+*/
+class chat_connection
+  : public std::enable_shared_from_this<chat_connection>
+{
+public:
+  typedef boost::asio::ip::tcp tcp;
+
+  // Bytes and frames sent and received, readable from any thread
+  struct traffic
+  {
+    std::atomic<std::uint64_t> frames_in{0};
+    std::atomic<std::uint64_t> bytes_in{0};
+    std::atomic<std::uint64_t> frames_out{0};
+    std::atomic<std::uint64_t> bytes_out{0};
+  };
+
+  chat_connection(boost::asio::io_service& io_service, const chat_events& events,
+      const chat_connection_options& options = chat_connection_options())
+    : socket_(io_service),
+      strand_(io_service),
+      events_(events),
+      options_(options),
+      connected_(false),
+      closed_(false),
+      protocol_(1),
+      checksum_(checksum_crc32),
+      switching_checksum_(false),
+      checksum_grace_(0),
+      writing_(0),
+      users_delta_(false),
+      rooms_delta_(false),
+      subscribed_(false)
+  {
+  }
+
+  void connect(tcp::resolver::iterator endpoints)
+  {
+    auto self(shared_from_this());
+    boost::asio::async_connect(socket_, endpoints, strand_.wrap(
+          [this, self](boost::system::error_code ec, tcp::resolver::iterator)
+          {
+            on_connect(ec);
+          }));
+  }
+
+  void connect(const tcp::endpoint& endpoint)
+  {
+    auto self(shared_from_this());
+    socket_.async_connect(endpoint, strand_.wrap(
+          [this, self](boost::system::error_code ec)
+          {
+            on_connect(ec);
+          }));
+  }
+
+  // Queues the request [command] with [data].
+  void request(const std::string& command, const std::string& data = "")
+  {
+    auto self(shared_from_this());
+    strand_.post(
+        [this, self, command, data]()
+        {
+          queue(command, data);
+        });
+  }
+
+  void send_text(const std::string& text) { request("SENDTEXT", text); }
+  void set_nick(const std::string& name) { request("NICK", name); }
+  void create_room(const std::string& room) { request("NAMECHATROOM", room); }
+  void change_room(const std::string& room) { request("CHANGECHATROOM", room); }
+
+  void request_users()
+  {
+    auto self(shared_from_this());
+    strand_.post(
+        [this, self]()
+        {
+          queue("USERSDELTA", users_version_);
+          if (!users_delta_)
+            queue("REQUSERS", "");
+        });
+  }
+
+  void request_rooms()
+  {
+    auto self(shared_from_this());
+    strand_.post(
+        [this, self]()
+        {
+          queue("ROOMSDELTA", rooms_version_);
+          if (!rooms_delta_)
+            queue("REQCHATROOMS", "");
+        });
+  }
+
+  // Polls for new messages, unless they are pushed to us anyway.
+  void request_text()
+  {
+    if (!subscribed_)
+      request("REQTEXT");
+  }
+
+  // true once the server acknowledged SUBSCRIBE
+  bool subscribed() const
+  {
+    return subscribed_;
+  }
+
+  const traffic& get_traffic() const
+  {
+    return traffic_;
+  }
+
+  void close()
+  {
+    auto self(shared_from_this());
+    strand_.post([this, self]() { shut(boost::asio::error::operation_aborted); });
+  }
+
+private:
+  void on_connect(boost::system::error_code ec)
+  {
+    if (ec)
+    {
+      shut(ec);
+      return;
+    }
+    boost::system::error_code ignored;
+    socket_.set_option(tcp::no_delay(true), ignored);
+    connected_ = true;
+    // the handshake goes out before anything requested while connecting
+    std::deque<std::pair<std::string, std::string>> waiting;
+    waiting.swap(pending_);
+    if (options_.request_uuid)
+      queue("REQUUID", "");
+    if (options_.v2)
+      queue("PROTOCOL", "2");
+    if (options_.v2 && options_.compress)
+      queue("COMPRESS", "DEFLATE");
+    if (options_.crc32c && crc32c_hw_available())
+    {
+      queue("CHECKSUM", "CRC32C");
+      switching_checksum_ = true;
+    }
+    if (options_.subscribe)
+      queue("SUBSCRIBE", "");
+    for (auto& req: waiting)
+      queue(req.first, req.second);
+    do_read_header();
+  }
+
+  // Encodes a request and starts writing if nothing is being written.
+  // Until the connection is up requests are kept as they are, since the
+  // checksum to encode them with is not known yet.
+  void queue(const std::string& command, const std::string& data)
+  {
+    if (closed_)
+      return;
+    if (!connected_)
+    {
+      pending_.push_back(std::make_pair(command, data));
+      return;
+    }
+    chat_message msg;
+    encode_request(msg, command, data, checksum_);
+    bool write_in_progress = !write_msgs_.empty();
+    write_msgs_.push_back(std::move(msg));
+    if (!write_in_progress)
+      do_write();
+  }
+
+  void shut(boost::system::error_code ec)
+  {
+    if (closed_)
+      return;
+    closed_ = true;
+    boost::system::error_code ignored;
+    socket_.close(ignored);
+    if (events_.on_closed)
+      events_.on_closed(ec);
+  }
+
+  // Reads the header of the next frame, v1 or v2, in as many steps as the
+  // v2 varint needs.
+  void do_read_header(std::size_t have = 0)
+  {
+    auto self(shared_from_this());
+    std::size_t want = have == 0 ? std::size_t(chat_message::header_length)
+      : read_msg_.missing_header_bytes(have);
+    boost::asio::async_read(socket_,
+        boost::asio::buffer(read_msg_.header_buffer() + have, want),
+        strand_.wrap([this, self, have, want](boost::system::error_code ec, std::size_t)
+        {
+          if (!ec && read_msg_.missing_header_bytes(have + want) > 0)
+            do_read_header(have + want);
+          else if (!ec && read_msg_.decode_header(have + want))
+            do_read_body(have + want);
+          else
+            shut(ec ? ec : boost::asio::error::invalid_argument);
+        }));
+  }
+
+  void do_read_body(std::size_t header_length)
+  {
+    auto self(shared_from_this());
+    boost::asio::async_read(socket_,
+        boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
+        strand_.wrap([this, self, header_length](boost::system::error_code ec,
+            std::size_t length)
+        {
+          if (ec)
+          {
+            shut(ec);
+            return;
+          }
+          traffic_.frames_in++;
+          traffic_.bytes_in += header_length + length;
+          if (read_msg_.type() == chat_message::v2_deflate)
+          {
+            // a batch of backlog frames, handled as if they came one by one
+            if (!inflate_frames(read_msg_,
+                  [this](const chat_message& msg) { handle_frame(msg); }))
+            {
+              shut(boost::asio::error::invalid_argument);
+              return;
+            }
+          }
+          else
+          {
+            handle_frame(read_msg_);
+          }
+          do_read_header();
+        }));
+  }
+
+  // Checks [msg] against the checksum in effect. Room messages the server
+  // built for us just before or after it switched can carry the other one,
+  // so that is accepted too from the CHECKSUM request until
+  // [checksum_grace_frames] frames after the acknowledgement, like the
+  // server accepts crc32 from a client that has not seen its ack yet.
+  bool checksum_matches(const chat_message& msg)
+  {
+    bool grace = switching_checksum_ || checksum_grace_ > 0;
+    if (checksum_grace_ > 0)
+      --checksum_grace_;
+    if (verify_checksum(msg.body(), msg.body_length(), checksum_))
+      return true;
+    checksum_kind other = checksum_ == checksum_crc32
+      ? checksum_crc32c : checksum_crc32;
+    return grace && verify_checksum(msg.body(), msg.body_length(), other);
+  }
+
+  // Handles the line from the server in the frame [msg]. Lines that fail
+  // their checksum are only passed to on_line; room messages pushed to
+  // clients that did not subscribe carry none and come again in REQTEXT.
+  void handle_frame(const chat_message& msg)
+  {
+    boost::string_view line(msg.body(), msg.body_length());
+    if (events_.on_line)
+      events_.on_line(line);
+    command_line cmd;
+    if (!checksum_matches(msg) || !parse_command(line, cmd))
+      return;
+    if (cmd.command == "REQTEXT")
+    {
+      boost::string_view token = parse_reqtext_page(cmd.args,
+          [this](boost::string_view sender, boost::string_view text)
+          {
+            if (events_.on_message)
+              events_.on_message(std::string(sender), std::string(text));
+          });
+      // a page of a longer backlog ends in +<token>, ask for the next
+      if (!token.empty())
+        queue("REQTEXT", std::string(token));
+    }
+    else if (cmd.command == "REQUUID")
+    {
+      if (events_.on_uuid)
+        events_.on_uuid(std::string(cmd.args));
+    }
+    else if (cmd.command == "CHANGECHATROOM")
+    {
+      if (events_.on_room_changed)
+        events_.on_room_changed(std::string(cmd.args));
+    }
+    else if (cmd.command == "REQUSERS")
+    {
+      if (events_.on_users)
+        events_.on_users(parse_user_list(cmd.args));
+    }
+    else if (cmd.command == "REQCHATROOMS")
+    {
+      if (events_.on_rooms)
+        events_.on_rooms(parse_room_list(cmd.args));
+    }
+    else if (cmd.command == "USERSDELTA")
+    {
+      boost::string_view entries;
+      users_version_ = std::string(split_delta(cmd.args, entries));
+      users_delta_ = true;
+      apply_user_delta(entries, members_);
+      if (events_.on_users)
+      {
+        std::vector<chat_user> users;
+        for (const auto& member : members_)
+          users.push_back(member.second);
+        events_.on_users(users);
+      }
+    }
+    else if (cmd.command == "ROOMSDELTA")
+    {
+      boost::string_view entries;
+      rooms_version_ = std::string(split_delta(cmd.args, entries));
+      rooms_delta_ = true;
+      apply_room_delta(entries, room_list_);
+      if (events_.on_rooms)
+        events_.on_rooms(room_list_);
+    }
+    else if (cmd.command == "NICK")
+    {
+      if (events_.on_nick)
+        events_.on_nick(std::string(cmd.args));
+    }
+    else if (cmd.command == "MISSED")
+    {
+      if (events_.on_missed)
+        events_.on_missed(std::strtoull(std::string(cmd.args).c_str(), NULL, 10));
+    }
+    else if (cmd.command == "SUBSCRIBE")
+    {
+      subscribed_ = true;
+    }
+    else if (cmd.command == "CHECKSUM")
+    {
+      // everything after the acknowledgement uses the new checksum, give or
+      // take the frames that were already built
+      checksum_ = cmd.args == "CRC32C" ? checksum_crc32c : checksum_crc32;
+      switching_checksum_ = false;
+      checksum_grace_ = checksum_grace_frames;
+    }
+    else if (cmd.command == "PROTOCOL")
+    {
+      // the server agreed on a framing, send everything else in it
+      protocol_ = cmd.args == "2" ? 2 : 1;
+    }
+  }
+
+  // Sends everything queued, up to [max_write_bytes] and
+  // [max_write_buffers], with one gather write.
+  void do_write()
+  {
+    auto self(shared_from_this());
+    write_buffers_.clear();
+    writing_ = 0;
+    std::size_t bytes = 0;
+    for (auto& msg: write_msgs_)
+    {
+      std::size_t length = protocol_ == 2
+        ? msg.v2_header_length() + msg.body_length() : msg.length();
+      if (writing_ > 0
+          && (write_buffers_.size() >= max_write_buffers
+            || bytes + length > max_write_bytes))
+        break;
+      if (protocol_ == 2)
+      {
+        write_buffers_.push_back(boost::asio::buffer(msg.v2_header(), msg.v2_header_length()));
+        write_buffers_.push_back(boost::asio::buffer(msg.body(), msg.body_length()));
+      }
+      else
+      {
+        write_buffers_.push_back(boost::asio::buffer(msg.data(), msg.length()));
+      }
+      bytes += length;
+      ++writing_;
+    }
+    boost::asio::async_write(socket_, write_buffers_,
+        strand_.wrap([this, self](boost::system::error_code ec, std::size_t length)
+        {
+          if (ec)
+          {
+            shut(ec);
+            return;
+          }
+          traffic_.frames_out += writing_;
+          traffic_.bytes_out += length;
+          write_msgs_.erase(write_msgs_.begin(), write_msgs_.begin() + writing_);
+          if (!write_msgs_.empty())
+            do_write();
+        }));
+  }
+
+  enum { max_write_bytes = 16 * 1024 };
+  enum { checksum_grace_frames = 64 };
+  enum { max_write_buffers = 32 };
+
+  tcp::socket socket_;
+  boost::asio::io_service::strand strand_;
+  chat_events events_;
+  chat_connection_options options_;
+  // everything below is only touched on [strand_], except [subscribed_]
+  // and [traffic_]
+  bool connected_;
+  bool closed_;
+  // requests made before the connection was up
+  std::deque<std::pair<std::string, std::string>> pending_;
+  chat_message read_msg_;
+  std::deque<chat_message> write_msgs_;
+  // the framing we send in, 2 once the server acknowledged PROTOCOL,2
+  int protocol_;
+  // the checksum we send and expect, set when the server acknowledges it
+  checksum_kind checksum_;
+  // set from the CHECKSUM request until its acknowledgement, and the frames
+  // after it that may still carry the old checksum
+  bool switching_checksum_;
+  unsigned int checksum_grace_;
+  // the buffers of the write in progress and how many frames they cover
+  std::vector<boost::asio::const_buffer> write_buffers_;
+  std::size_t writing_;
+  // the lists as of the versions the server last sent, and whether it
+  // sends versions at all
+  std::string users_version_;
+  std::map<unsigned long, chat_user> members_;
+  bool users_delta_;
+  std::string rooms_version_;
+  std::vector<std::string> room_list_;
+  bool rooms_delta_;
+  std::atomic<bool> subscribed_;
+  traffic traffic_;
+};
+
+typedef std::shared_ptr<chat_connection> chat_connection_ptr;
+
+#endif // CHAT_CONNECTION_HPP
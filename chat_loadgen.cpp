@@ -0,0 +1,486 @@
+//
+// chat_loadgen.cpp
+// ~~~~~~~~~~~~~~~~
+//
+// Headless load generator for chat_server: many simulated clients on one
+// io_service, measuring throughput and send-to-receive latency.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <boost/asio.hpp>
+#include "chat_connection.hpp"
+#include "server_metrics.hpp"
+
+using boost::asio::ip::tcp;
+
+//----------------------------------------------------------------------
+
+/*
+  Settings taken from the command line.
+*/
+struct loadgen_options
+{
+  // simulated clients and the rooms they are spread over
+  unsigned int clients = 100;
+  unsigned int rooms = 10;
+  // uniform puts the same number of clients in every room, zipf makes room
+  // k about 1/(k+1) as busy as the first one
+  enum room_spread { rooms_uniform, rooms_zipf };
+  room_spread spread = rooms_uniform;
+  // messages each client sends per second, on average
+  double rate = 1.0;
+  // milliseconds between REQTEXT polls, 0 to SUBSCRIBE instead
+  unsigned int poll_ms = 100;
+  // bytes of text in each message
+  std::size_t message_bytes = 32;
+  // new connections opened per second while ramping up
+  unsigned int ramp = 2000;
+  // seconds to wait after ramping up and seconds to measure for
+  unsigned int warmup = 1;
+  unsigned int duration = 10;
+  // seconds to wait after measuring for the messages sent while measuring
+  unsigned int drain = 5;
+  // threads running the io_service, 0 means one per core
+  unsigned int threads = 0;
+};
+
+/*
+  Totals of all clients. Latency is the time from a client queueing a
+  SENDTEXT until a client in the same room reads the message in a REQTEXT
+  reply, for the messages sent between [measure_from] and [measure_to],
+  however late they arrive. Every such message should reach everyone in
+  its room, [expected] deliveries in all; those that have not arrived
+  when the drain time is up count as lost.
+*/
+struct loadgen_stats
+{
+  explicit loadgen_stats(unsigned int rooms)
+    : room_members(new std::atomic<std::uint32_t>[rooms])
+  {
+    for (unsigned int i = 0; i < rooms; ++i)
+      room_members[i] = 0;
+  }
+
+  std::atomic<std::uint64_t> ready{0};
+  std::atomic<std::uint64_t> failed{0};
+  std::atomic<std::uint64_t> sent{0};
+  std::atomic<std::uint64_t> received{0};
+  // clients only start talking once every client got the chance to join,
+  // so a slow ramp up is not measured as a slow server
+  std::atomic<bool> sending{false};
+  // the measured window, empty until it starts and open ended until it ends
+  std::atomic<std::int64_t> measure_from{INT64_MAX};
+  std::atomic<std::int64_t> measure_to{INT64_MAX};
+  // cleared when the drain time is up, later arrivals are not counted
+  std::atomic<bool> recording{true};
+  std::atomic<std::uint64_t> expected{0};
+  std::atomic<std::uint64_t> delivered{0};
+  // clients in each room, the number of deliveries one message makes
+  std::unique_ptr<std::atomic<std::uint32_t>[]> room_members;
+  latency_histogram latency;
+
+  bool measured(std::int64_t sent_ns) const
+  {
+    return sent_ns >= measure_from.load(std::memory_order_relaxed)
+      && sent_ns < measure_to.load(std::memory_order_relaxed);
+  }
+};
+
+// Nanoseconds on the steady clock, the time stamp carried in every message
+std::int64_t now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//----------------------------------------------------------------------
+
+/*
+  One simulated client, a chat_connection driven by two timers. It gets a
+  uuid, picks a nickname, creates and joins its room, then sends SENDTEXT
+  at random intervals averaging 1/rate seconds and polls with REQTEXT (or
+  subscribes) for what the room says. Every message carries
+  "lg <client> <send time>" so a receiver can tell how long it took.
+
+  The timers are only touched on [strand_]; the connection's handlers run
+  on its own strand and post to this one.
+*/
+class load_client
+  : public std::enable_shared_from_this<load_client>
+{
+public:
+  load_client(boost::asio::io_service& io_service,
+      const loadgen_options& options, loadgen_stats& stats,
+      unsigned int number, unsigned int room)
+    : strand_(io_service),
+      send_timer_(io_service),
+      poll_timer_(io_service),
+      options_(options),
+      stats_(stats),
+      number_(number),
+      room_(room),
+      random_(number),
+      ready_(false)
+  {
+    chat_connection_options settings;
+    settings.v2 = false;
+    settings.crc32c = false;
+    settings.subscribe = options.poll_ms == 0;
+    // The connection lives no longer than its client in main, so the
+    // handlers can hold [this].
+    chat_events events;
+    events.on_uuid = [this](const std::string&) { on_uuid(); };
+    events.on_room_changed = [this](const std::string&) { on_joined(); };
+    events.on_message = [this](const std::string&, const std::string& text)
+    {
+      on_message(text);
+    };
+    events.on_closed = [this](const boost::system::error_code&) { on_closed(); };
+    connection_ = std::make_shared<chat_connection>(io_service, events, settings);
+  }
+
+  void start(const tcp::endpoint& endpoint)
+  {
+    connection_->connect(endpoint);
+  }
+
+  const chat_connection::traffic& get_traffic() const
+  {
+    return connection_->get_traffic();
+  }
+
+private:
+  void on_uuid()
+  {
+    connection_->set_nick("load" + std::to_string(number_));
+    connection_->create_room(room_name());
+    connection_->change_room(room_name());
+  }
+
+  std::string room_name() const
+  {
+    return "room" + std::to_string(room_);
+  }
+
+  void on_joined()
+  {
+    if (ready_)
+      return;
+    ready_ = true;
+    stats_.ready++;
+    stats_.room_members[room_]++;
+    auto self(shared_from_this());
+    strand_.post(
+        [this, self]()
+        {
+          if (options_.poll_ms > 0)
+            schedule_poll();
+          schedule_send();
+        });
+  }
+
+  void on_closed()
+  {
+    stats_.failed++;
+    if (ready_)
+    {
+      stats_.ready--;
+      stats_.room_members[room_]--;
+    }
+    auto self(shared_from_this());
+    strand_.post(
+        [this, self]()
+        {
+          boost::system::error_code ignored;
+          send_timer_.cancel(ignored);
+          poll_timer_.cancel(ignored);
+        });
+  }
+
+  // Records the latency of a load generator message.
+  void on_message(const std::string& text)
+  {
+    if (text.compare(0, 3, "lg ") != 0)
+      return;
+    stats_.received++;
+    std::int64_t now = now_ns();
+    unsigned long long client;
+    long long sent;
+    if (stats_.recording.load(std::memory_order_relaxed)
+        && std::sscanf(text.c_str(), "lg %llu %lld", &client, &sent) == 2
+        && stats_.measured(sent))
+    {
+      stats_.delivered++;
+      stats_.latency.record(now >= sent ? now - sent : 0);
+    }
+  }
+
+  void schedule_send()
+  {
+    auto self(shared_from_this());
+    std::exponential_distribution<double> interval(options_.rate);
+    send_timer_.expires_from_now(std::chrono::microseconds(
+          static_cast<std::int64_t>(interval(random_) * 1e6)));
+    send_timer_.async_wait(strand_.wrap(
+        [this, self](boost::system::error_code ec)
+        {
+          if (ec)
+            return;
+          if (stats_.sending.load(std::memory_order_relaxed))
+          {
+            std::int64_t sent = now_ns();
+            // everyone in the room gets it, the sender included
+            if (stats_.measured(sent))
+              stats_.expected += stats_.room_members[room_];
+            std::string text = "lg " + std::to_string(number_) + " "
+              + std::to_string(sent) + " ";
+            if (text.size() < options_.message_bytes)
+              text.append(options_.message_bytes - text.size(), 'x');
+            connection_->send_text(text);
+            stats_.sent++;
+          }
+          schedule_send();
+        }));
+  }
+
+  void schedule_poll()
+  {
+    auto self(shared_from_this());
+    poll_timer_.expires_from_now(std::chrono::milliseconds(options_.poll_ms));
+    poll_timer_.async_wait(strand_.wrap(
+        [this, self](boost::system::error_code ec)
+        {
+          if (ec)
+            return;
+          connection_->request_text();
+          schedule_poll();
+        }));
+  }
+
+  chat_connection_ptr connection_;
+  boost::asio::io_service::strand strand_;
+  boost::asio::steady_timer send_timer_;
+  boost::asio::steady_timer poll_timer_;
+  const loadgen_options& options_;
+  loadgen_stats& stats_;
+  unsigned int number_;
+  unsigned int room_;
+  // only used on [strand_]
+  std::mt19937 random_;
+  // only touched from the connection's handlers
+  bool ready_;
+};
+
+//----------------------------------------------------------------------
+
+/*
+  The room_for function returns the number of the room client [number]
+  joins. Rooms are named room0, room1 and so on.
+*/
+unsigned int room_for(unsigned int number, const loadgen_options& options,
+    std::mt19937& random)
+{
+  if (options.spread == loadgen_options::rooms_uniform)
+    return number % options.rooms;
+  std::vector<double> weights;
+  for (unsigned int k = 0; k < options.rooms; ++k)
+    weights.push_back(1.0 / (k + 1));
+  std::discrete_distribution<unsigned int> pick(weights.begin(), weights.end());
+  return pick(random);
+}
+
+// Adds up the bytes all [clients] sent and received so far.
+void total_traffic(const std::vector<std::shared_ptr<load_client>>& clients,
+    std::uint64_t& out, std::uint64_t& in)
+{
+  out = 0;
+  in = 0;
+  for (const auto& client: clients)
+  {
+    out += client->get_traffic().bytes_out;
+    in += client->get_traffic().bytes_in;
+  }
+}
+
+// Tens of thousands of clients need as many file descriptors.
+void raise_fd_limit()
+{
+  struct rlimit limit;
+  if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+  {
+    limit.rlim_cur = limit.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  try
+  {
+    // Options come in pairs before the host and port:
+    //   -c <clients>   simulated clients, 100 by default
+    //   -r <rooms>     rooms they are spread over, 10 by default
+    //   -z <spread>    uniform (the default) or zipf
+    //   -s <rate>      messages per second each client sends, 1 by default
+    //   -p <ms>        milliseconds between REQTEXT polls, 0 to SUBSCRIBE
+    //   -b <bytes>     bytes of text in each message
+    //   -a <clients>   connections opened per second while ramping up
+    //   -w <seconds>   time to settle before measuring
+    //   -d <seconds>   time to measure for
+    //   -e <seconds>   time to wait for the measured messages afterwards
+    //   -t <threads>   threads running the io_service, one per core by default
+    loadgen_options options;
+    int first_arg = 1;
+    while (first_arg + 1 < argc && argv[first_arg][0] == '-')
+    {
+      std::string flag = argv[first_arg];
+      const char* value = argv[first_arg + 1];
+      if (flag == "-c")
+        options.clients = std::atoi(value);
+      else if (flag == "-r" && std::atoi(value) > 0)
+        options.rooms = std::atoi(value);
+      else if (flag == "-z" && std::string(value) == "uniform")
+        options.spread = loadgen_options::rooms_uniform;
+      else if (flag == "-z" && std::string(value) == "zipf")
+        options.spread = loadgen_options::rooms_zipf;
+      else if (flag == "-s" && std::atof(value) > 0)
+        options.rate = std::atof(value);
+      else if (flag == "-p")
+        options.poll_ms = std::atoi(value);
+      else if (flag == "-b")
+        options.message_bytes = std::strtoull(value, NULL, 10);
+      else if (flag == "-a" && std::atoi(value) > 0)
+        options.ramp = std::atoi(value);
+      else if (flag == "-w")
+        options.warmup = std::atoi(value);
+      else if (flag == "-d" && std::atoi(value) > 0)
+        options.duration = std::atoi(value);
+      else if (flag == "-e")
+        options.drain = std::atoi(value);
+      else if (flag == "-t")
+        options.threads = std::atoi(value);
+      else
+        break;
+      first_arg += 2;
+    }
+    if (argc != first_arg + 2)
+    {
+      std::cerr << "Usage: chat_loadgen [-c <clients>] [-r <rooms>]"
+        " [-z uniform|zipf] [-s <rate>] [-p <ms>] [-b <bytes>] [-a <clients>]"
+        " [-w <seconds>] [-d <seconds>] [-e <seconds>] [-t <threads>]"
+        " <host> <port>\n";
+      return 1;
+    }
+    // a v1 frame holds 512 bytes of body, the request fields take some
+    if (options.message_bytes > 400)
+      options.message_bytes = 400;
+    unsigned int thread_count = options.threads;
+    if (thread_count < 1)
+      thread_count = std::thread::hardware_concurrency();
+    if (thread_count < 1)
+      thread_count = 1;
+    raise_fd_limit();
+
+    boost::asio::io_service io_service;
+    tcp::resolver resolver(io_service);
+    tcp::endpoint endpoint = *resolver.resolve({ argv[first_arg], argv[first_arg + 1] });
+    std::unique_ptr<boost::asio::io_service::work> work(
+        new boost::asio::io_service::work(io_service));
+    std::vector<std::thread> pool;
+    for (unsigned int i = 0; i < thread_count; ++i)
+      pool.emplace_back([&io_service](){ io_service.run(); });
+
+    // Connect in steps of 10ms at the ramp rate, so the server's accept
+    // backlog does not overflow.
+    loadgen_stats stats(options.rooms);
+    std::mt19937 random(1);
+    std::vector<std::shared_ptr<load_client>> clients;
+    auto started = std::chrono::steady_clock::now();
+    unsigned int per_step = options.ramp / 100 > 0 ? options.ramp / 100 : 1;
+    while (clients.size() < options.clients)
+    {
+      for (unsigned int i = 0; i < per_step && clients.size() < options.clients; ++i)
+      {
+        unsigned int number = clients.size();
+        clients.push_back(std::make_shared<load_client>(io_service, options,
+              stats, number, room_for(number, options, random)));
+        clients.back()->start(endpoint);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    while (stats.ready + stats.failed < options.clients
+        && std::chrono::steady_clock::now() - started < std::chrono::seconds(60))
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    double ramp_seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - started).count();
+    std::cout << stats.ready << " of " << options.clients << " clients ready in "
+      << ramp_seconds << "s, " << stats.failed << " failed" << std::endl;
+
+    stats.sending = true;
+    std::this_thread::sleep_for(std::chrono::seconds(options.warmup));
+    std::uint64_t sent = stats.sent, received = stats.received;
+    std::uint64_t bytes_out, bytes_in;
+    total_traffic(clients, bytes_out, bytes_in);
+    stats.measure_from = now_ns();
+    std::this_thread::sleep_for(std::chrono::seconds(options.duration));
+    stats.measure_to = now_ns();
+    sent = stats.sent - sent;
+    received = stats.received - received;
+    std::uint64_t end_out, end_in;
+    total_traffic(clients, end_out, end_in);
+    bytes_out = end_out - bytes_out;
+    bytes_in = end_in - bytes_in;
+
+    // Messages sent near the end of the window are still on their way; the
+    // slowest ones are the ones the percentiles are about.
+    auto drain_until = std::chrono::steady_clock::now()
+      + std::chrono::seconds(options.drain);
+    while (stats.delivered < stats.expected
+        && std::chrono::steady_clock::now() < drain_until)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    stats.recording = false;
+    std::uint64_t expected = stats.expected, delivered = stats.delivered;
+    std::uint64_t lost = delivered < expected ? expected - delivered : 0;
+
+    double seconds = options.duration;
+    const latency_histogram& latency = stats.latency;
+    std::cout << "clients " << stats.ready << ", rooms " << options.rooms
+      << ", " << seconds << "s measured\n"
+      << "sent " << sent << " messages (" << sent / seconds << "/s), "
+      << "received " << received << " (" << received / seconds << "/s)\n"
+      << "out " << bytes_out / seconds / 1024 << " KiB/s, "
+      << "in " << bytes_in / seconds / 1024 << " KiB/s\n"
+      << "latency us: p50 " << latency.percentile(50) / 1000.0
+      << " p90 " << latency.percentile(90) / 1000.0
+      << " p99 " << latency.percentile(99) / 1000.0
+      << " p999 " << latency.percentile(99.9) / 1000.0
+      << " max " << latency.max() / 1000.0
+      << " (" << latency.count() << " samples)\n"
+      << "lost " << lost << " of " << expected << " deliveries ("
+      << (expected > 0 ? 100.0 * lost / expected : 0.0) << "%) after waiting "
+      << options.drain << "s" << std::endl;
+
+    work.reset();
+    io_service.stop();
+    for (auto& t: pool)
+      t.join();
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Exception: " << e.what() << "\n";
+  }
+
+  return 0;
+}
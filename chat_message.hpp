@@ -14,41 +14,71 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <vector>
 
+/*
+  A chat_message is one frame on the wire. Two framings exist:
+
+  v1: a 4 character ASCII decimal body length ("%4lu") followed by at most
+      max_body_length bytes of body.
+  v2: the byte v2_magic, a message type byte, the body length as a
+      little-endian base 128 varint, then the body (up to max_v2_body_length).
+      The varint is always written with at least two bytes so a v2 header is
+      never shorter than a v1 header, and a reader can always start by
+      reading header_length bytes and tell the two apart by the first one.
+
+  The body lives on the heap and is sized to fit. encode_header() prepares
+  both headers, so a frame shared between v1 and v2 sessions is encoded once:
+  v1 writers send data()/length(), v2 writers send v2_header() and body().
+*/
 class chat_message
 {
 public:
   enum { header_length = 4 };
   enum { max_body_length = 512 };
+  enum { max_header_length = 7 };
+  enum { max_v2_body_length = 16 * 1024 * 1024 };
+  enum { v2_magic = 0xB2 };
+  // v2 message types: a protocol line, or a deflate batch of frames (see
+  // frame_deflate.hpp)
+  enum { v2_line = 1 };
+  enum { v2_deflate = 2 };
 
   chat_message()
-    : body_length_(0)
+    : data_(max_header_length),
+      body_length_(0),
+      type_(v2_line),
+      version_(1),
+      v2_header_(),
+      v2_header_length_(0)
   {
   }
 
+  // The v1 frame: header and body, the body cut at max_body_length
   const char* data() const
   {
-    return data_;
+    return data_.data() + max_header_length - header_length;
   }
 
   char* data()
   {
-    return data_;
+    return &data_[max_header_length - header_length];
   }
 
   std::size_t length() const
   {
-    return header_length + body_length_;
+    return header_length + v1_body_length();
   }
 
   const char* body() const
   {
-    return data_ + header_length;
+    return data_.data() + max_header_length;
   }
 
   char* body()
   {
-    return data_ + header_length;
+    return &data_[max_header_length];
   }
 
   std::size_t body_length() const
@@ -59,33 +89,158 @@ public:
   void body_length(std::size_t new_length)
   {
     body_length_ = new_length;
-    if (body_length_ > max_body_length)
-      body_length_ = max_body_length;
+    if (body_length_ > max_body_length_for(2))
+      body_length_ = max_body_length_for(2);
+    data_.resize(max_header_length + body_length_);
+  }
+
+  // The v2 header of the frame, valid after encode_header()
+  const char* v2_header() const
+  {
+    return v2_header_;
+  }
+
+  std::size_t v2_header_length() const
+  {
+    return v2_header_length_;
+  }
+
+  // The v2 message type of the frame
+  unsigned char type() const
+  {
+    return type_;
+  }
+
+  // The framing the last decoded header used, 1 or 2
+  int version() const
+  {
+    return version_;
+  }
+
+  // Incoming headers are read here, header_length bytes first and then
+  // whatever missing_header_bytes() asks for.
+  char* header_buffer()
+  {
+    return &data_[0];
+  }
+
+  // Given the first [have] bytes of a header in header_buffer(), returns how
+  // many more bytes must be read before decode_header() can be called.
+  std::size_t missing_header_bytes(std::size_t have) const
+  {
+    if (static_cast<unsigned char>(data_[0]) != v2_magic)
+      return have < header_length ? header_length - have : 0;
+    if (have < header_length)
+      return header_length - have;
+    if (have < max_header_length && (data_[have - 1] & 0x80))
+      return 1;
+    return 0;
   }
 
-  bool decode_header()
+  // Decodes the [have] header bytes in header_buffer() and sizes the body to
+  // match. Returns false for a malformed header or an oversized body.
+  bool decode_header(std::size_t have = header_length)
   {
-    char header[header_length + 1] = "";
-    std::strncat(header, data_, header_length);
-    body_length_ = std::atoi(header);
-    if (body_length_ > max_body_length)
+    std::size_t length = 0;
+    if (static_cast<unsigned char>(data_[0]) != v2_magic)
     {
-      body_length_ = 0;
-      return false;
+      for (std::size_t i = 0; i < header_length; ++i)
+      {
+        char c = data_[i];
+        if (c >= '0' && c <= '9')
+          length = length * 10 + (c - '0');
+        else if (c != ' ')
+          return fail();
+      }
+      version_ = 1;
+      type_ = v2_line;
     }
+    else
+    {
+      int shift = 0;
+      std::size_t i = 2;
+      for (; i < have; ++i, shift += 7)
+      {
+        length |= static_cast<std::size_t>(data_[i] & 0x7f) << shift;
+        if (!(data_[i] & 0x80))
+          break;
+      }
+      if (i == have)
+        return fail();
+      version_ = 2;
+      type_ = data_[1];
+    }
+    if (length > max_body_length_for(version_))
+      return fail();
+    body_length_ = length;
+    data_.resize(max_header_length + body_length_);
+    encode_header(type_);
     return true;
   }
 
   void encode_header()
   {
-    char header[header_length + 1] = "";
-    std::sprintf(header, "%4lu", body_length_);
-    std::memcpy(data_, header, header_length);
+    encode_header(type_);
+  }
+
+  // Writes both headers for the current body length, [type] goes in the v2 one
+  void encode_header(unsigned char type)
+  {
+    type_ = type;
+    char* header = data();
+    std::size_t n = v1_body_length();
+    for (int i = header_length - 1; i >= 0; --i)
+    {
+      header[i] = (n || i == header_length - 1) ? '0' + n % 10 : ' ';
+      n /= 10;
+    }
+
+    v2_header_[0] = static_cast<char>(v2_magic);
+    v2_header_[1] = type_;
+    std::size_t pos = 2;
+    n = body_length_;
+    do
+    {
+      v2_header_[pos] = n & 0x7f;
+      n >>= 7;
+      if (n || pos == 2)
+        v2_header_[pos] |= 0x80;
+      ++pos;
+    } while (n || pos < 4);
+    v2_header_length_ = pos;
+  }
+
+  static std::size_t max_body_length_for(int version)
+  {
+    return version == 2 ? std::size_t(max_v2_body_length)
+      : std::size_t(max_body_length);
   }
 
 private:
-  char data_[header_length + max_body_length];
+  std::size_t v1_body_length() const
+  {
+    return body_length_ > max_body_length ? std::size_t(max_body_length)
+      : body_length_;
+  }
+
+  bool fail()
+  {
+    body_length_ = 0;
+    data_.resize(max_header_length);
+    return false;
+  }
+
+  // max_header_length bytes of room for a header, then the body
+  std::vector<char> data_;
   std::size_t body_length_;
+  unsigned char type_;
+  int version_;
+  char v2_header_[max_header_length];
+  std::size_t v2_header_length_;
 };
 
+// An encoded frame that is never modified again, so one copy can sit in the
+// outbound queue of every session it is broadcast to.
+typedef std::shared_ptr<const chat_message> chat_message_ptr;
+
 #endif // CHAT_MESSAGE_HPP
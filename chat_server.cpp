@@ -8,19 +8,34 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <deque>
+#include <fstream>
 #include <iostream>
 #include <list>
 #include <string>
 #include <vector>
 #include <memory>
+#include <mutex>
 #include <set>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <boost/algorithm/string.hpp>
 #include <string>
 #include <boost/asio.hpp>
+#include "async_log.hpp"
 #include "chat_message.hpp"
+#include "frame_deflate.hpp"
+#include "name_registry.hpp"
+#include "room_history.hpp"
+#include "room_log.hpp"
+#include "server_metrics.hpp"
 #include "util.hpp"
 
 using boost::asio::ip::tcp;
@@ -28,74 +43,198 @@ using boost::asio::ip::tcp;
 //----------------------------------------------------------------------
 
 /*
-  Global vector to store the queue of messages sent to the server
+  Global queue of messages waiting to be written to a client. The frames are
+  shared with every other session they were sent to.
 */
-typedef std::vector<chat_message> chat_message_queue;
+typedef std::deque<chat_message_ptr> chat_message_queue;
+
+/*
+  Settings taken from the command line that the server, its rooms and its
+  sessions need.
+*/
+struct server_options
+{
+  // number of threads running the io_service, 0 means one per core
+  unsigned int threads = 0;
+  // the most messages each room keeps in its history
+  std::size_t max_recent_msgs = 100000;
+  // the most bytes of message bodies each room keeps, 0 for no limit
+  std::size_t max_recent_bytes = 64 * 1024 * 1024;
+  // directory the rooms and messages are logged to, empty to keep them only
+  // in memory
+  std::string log_dir;
+  // the most bytes and frames a session sends in one gather write
+  std::size_t max_write_bytes = 64 * 1024;
+  std::size_t max_write_buffers = 64;
+  // the most bytes of messages in one REQTEXT frame to a v2 client, v1
+  // clients always get pages that fit their 512 byte frames
+  std::size_t max_page_bytes = 64 * 1024;
+  // the most frames and bytes of bodies waiting to be sent to one client,
+  // and what happens to a client that falls further behind than that
+  std::size_t max_queue_frames = 10000;
+  std::size_t max_queue_bytes = 16 * 1024 * 1024;
+  enum queue_policy { queue_drop_oldest, queue_mark_missed, queue_disconnect };
+  queue_policy queue_full = queue_mark_missed;
+  // file the stats report is written to every [stats_interval] seconds,
+  // empty to only answer STATS
+  std::string stats_file;
+  unsigned int stats_interval = 10;
+  // token a client has to send with ADMIN before the server answers its
+  // STATS, REQQUEUES and LOGLEVEL, empty to answer them only for clients
+  // connected over loopback
+  std::string admin_token;
+};
+
+/*
+  Rooms and sessions are numbered by the chat_room so the hot paths compare
+  and index with integers; names are only looked up when a client sends or
+  asks for one. Room ids count up from 0, the default room, and are never
+  reused. Session ids are reused once a session leaves, so they stay dense.
+*/
+typedef std::uint32_t room_id;
+typedef std::uint32_t session_id;
+const session_id no_session = UINT32_MAX;
+
+/*
+  The state of the outbound queue of a participant: what is waiting now, the
+  most frames that ever waited, and how many frames were dropped because the
+  client did not keep up.
+*/
+struct queue_stats
+{
+  std::size_t frames = 0;
+  std::size_t bytes = 0;
+  std::size_t peak_frames = 0;
+  std::size_t dropped = 0;
+};
 
 //----------------------------------------------------------------------
 
 /*
   The chart participant class contains needed information about each user
-  connected to the server.
+  connected to the server. The server runs on several threads, so the fields
+  of a participant are guarded by [state_mutex_]; the getters return copies.
 */
 class chat_participant
 {
 public:
   virtual ~chat_participant() {}
 
-  virtual void deliver(const chat_message& msg) = 0;
+  virtual void deliver(const chat_message_ptr& msg) = 0;
+
+  virtual queue_stats get_queue_stats() const = 0;
 
   // A function to change the private uuid variable with the [str] parameter
   void set_uuid(std::string str) {
+    std::lock_guard<std::mutex> lock(state_mutex_);
     uuid = str;
   }
 
   // A function to change the private name variable with the [str] parameter
   void set_name(std::string str) {
+    std::lock_guard<std::mutex> lock(state_mutex_);
     name = str;
   }
 
   // A getter function to return the uuid of the participant
   std::string get_uuid() {
+    std::lock_guard<std::mutex> lock(state_mutex_);
     return uuid;
   }
 
   // A getter function to return the name of the participant
   std::string get_name() {
+    std::lock_guard<std::mutex> lock(state_mutex_);
     return name;
   }
 
   // A getter function to check what room the user is currently in
-  std::string get_room() {
+  room_id get_room() {
+    std::lock_guard<std::mutex> lock(state_mutex_);
     return room;
   }
 
-  // The send_text function takes a chat_message [msg] as a parameter and
-  // inserts it into the vector of messages that the user has already been sent
-  // by the server [the sent_text vector.]
-  void send_text(const chat_message& msg) {
-    sent_text.push_back(msg);
+  // The set_cursor function takes the position [pos] in the room's message
+  // log of the first message the user has not been sent yet.
+  void set_cursor(std::size_t pos) {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    cursor = pos;
   }
 
-  // The set_room function takes a string [str] as a parameter and uses it to
+  // The set_room function takes a room id [id] as a parameter and uses it to
   // update the room that the user is currently in. When this occurs, we must
-  // clear the [sent_text] vector so it can be updated to the new rooms messages.
-  void set_room(std::string str) {
-    room = str;
-    sent_text.clear();//need to refresh the chat buffer when a new room is joined
-    if(DEBUG_MODE)
-      std::cout << uuid << " joined: " << room << std::endl;
+  // rewind the [cursor] so the new room's messages are all sent.
+  void set_room(room_id id) {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    room = id;
+    cursor = 0;//need to refresh the chat buffer when a new room is joined
   }
 
-  // The get_sent function returns the vector [sent_text] which is a list of
-  // messages which have already been sent to the participant so that the server
+  // The get_cursor function returns the position in the room's message log
+  // of the first message the participant has not been sent, so the server
   // does not send duplicates.
-  chat_message_queue get_sent() {
-    return sent_text;
+  std::size_t get_cursor() {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    return cursor;
+  }
+
+  // A participant that sent SUBSCRIBE gets new room messages pushed to it as
+  // REQTEXT replies instead of waiting for its next poll.
+  void set_subscribed(bool on) {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    subscribed = on;
   }
+
+  bool is_subscribed() {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    return subscribed;
+  }
+
+  // The checksum the frames sent to and from this participant carry
+  void set_checksum(checksum_kind kind) {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    checksum = kind;
+  }
+
+  checksum_kind get_checksum() {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    return checksum;
+  }
+
+  // The framing the participant is sent, 1 or 2, which decides how much
+  // history fits in one REQTEXT frame
+  void set_protocol(int version) {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    protocol = version;
+  }
+
+  int get_protocol() {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    return protocol;
+  }
+
+  // A participant that sent COMPRESS,DEFLATE gets backlog replay packed into
+  // deflate batches
+  void set_compressed(bool on) {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    compressed = on;
+  }
+
+  bool is_compressed() {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    return compressed;
+  }
+
+  // The id the chat_room gave this participant when it joined, no_session
+  // before that and after it left. Only the chat_room touches it, under its
+  // own mutex, so it needs no lock here.
+  session_id id = no_session;
 private:
-  // vector to keep track of messages the user has already been sent
-  chat_message_queue sent_text;
+  // guards every field below, participants are read from any server thread
+  std::mutex state_mutex_;
+
+  // position in the room's message log of the next message to send the user
+  std::size_t cursor = 0;
 
   // a string to keep track of the users nick name
   std::string name;
@@ -103,150 +242,478 @@ private:
   // a string to keep track of the users uuid
   std::string uuid;
 
-  // a string to keep track of the users chat room
-  // by default this is "the lobby", it can be changed later
-  std::string room = "the lobby";
+  // the id of the users chat room
+  // by default this is room 0, "the lobby", it can be changed later
+  room_id room = 0;
+
+  // true once the user opted in to server push with SUBSCRIBE
+  bool subscribed = false;
+
+  // crc32 until the user asks for something else with CHECKSUM
+  checksum_kind checksum = checksum_crc32;
+
+  // v1 until the user talks v2 or asks for it with PROTOCOL
+  int protocol = 1;
+
+  // true once the user asked for compressed backlog with COMPRESS
+  bool compressed = false;
 };
 
 // chat_participant_ptr keeps track of pointers to participants
 typedef std::shared_ptr<chat_participant> chat_participant_ptr;
 
+/*
+  The deliver_backlog function sends the history frames [frames] to [part].
+  Participants that asked for compression get them packed into deflate
+  batches of about [page_bytes] bytes of bodies each; everybody else, and
+  backlogs too small to be worth packing, get the frames as they are.
+*/
+void deliver_backlog(const chat_participant_ptr& part,
+    const std::vector<chat_message_ptr>& frames, std::size_t page_bytes) {
+  // below this many bytes a batch costs more than it saves
+  static const std::size_t min_deflate_bytes = 512;
+  bool compressed = part->is_compressed();
+  std::vector<chat_message_ptr> batch;
+  std::size_t bytes = 0;
+  auto flush = [&]()
+  {
+    chat_message_ptr packed;
+    if(compressed && bytes >= min_deflate_bytes) {
+      packed = deflate_frames(batch);
+    }
+    if(packed) {
+      part->deliver(packed);
+    } else {
+      for(const chat_message_ptr& frame: batch) {
+        part->deliver(frame);
+      }
+    }
+    batch.clear();
+    bytes = 0;
+  };
+  for(const chat_message_ptr& frame: frames) {
+    batch.push_back(frame);
+    bytes += frame->body_length();
+    if(bytes >= page_bytes) {
+      flush();
+    }
+  }
+  flush();
+}
+
 //----------------------------------------------------------------------
 
 
 //----------------------------------------------------------------------
 /*
   The chat_room class contains variables and methods to manage multiple chat
-  rooms.
+  rooms. Sessions call into it from every thread of the io_service pool, so
+  each public method takes [mutex_] for its whole body. A participant's own
+  lock may be taken while [mutex_] is held, never the other way around.
 */
 class chat_room
 {
 public:
-  chat_room(const char* nm) : name{nm} {
+  chat_room(const char* nm, const server_options& options)
+    : name{nm}, log_(NULL), log_segment_(0), options_(options),
+      room_list_stale_(true) {
     create_room(std::string(name));
   };
-  // The join function takes a pointer to a participant [participant] and
-  // inserts that pointer into a list to keep track of the users in a room
+
+  // The restore function replays everything stored in [log] into the rooms
+  // and their histories, then records every later room and message in it.
+  void restore(room_log& log) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::size_t records = log.replay(
+        [this](const std::string& room_name)
+        {
+          find_or_add_room(room_name);
+        },
+        [this, &log](const std::string& room_name, const char* body,
+            std::size_t length)
+        {
+          room_id id = find_or_add_room(room_name);
+          std::shared_ptr<chat_message> msg = std::make_shared<chat_message>();
+          msg->body_length(length);
+          std::memcpy(msg->body(), body, msg->body_length());
+          msg->encode_header();
+          room_history& history = rooms_[id].history;
+          history.push_back(msg);
+          note_segment(rooms_[id], history.end_seq() - 1, log.replaying());
+        });
+    CHAT_LOG(log_info) << records << " records restored from the log";
+    log_ = &log;
+    log_segment_ = log.replaying();
+    release_segments();
+  }
+
+  // The join function takes a pointer to a participant [participant], gives
+  // it a session id and adds it to the members of its room.
   // Since we are polling from the client, we do not need to deliver the messages
   // here anymore.
   void join(chat_participant_ptr participant)
   {
-    participants_.insert(participant);
-    /*for (auto msg: recent_msgs_)
-      participant->deliver(msg);*/
+    std::lock_guard<std::mutex> lock(mutex_);
+    session_id id;
+    if(!free_ids_.empty()) {
+      id = free_ids_.back();
+      free_ids_.pop_back();
+      sessions_[id] = participant;
+    } else {
+      id = sessions_.size();
+      sessions_.push_back(participant);
+      member_slot_.push_back(0);
+    }
+    participant->id = id;
+    add_member(rooms_[participant->get_room()], id);
   }
 
-  // The leave function removes a participant from the list of participants.
-  void leave(chat_participant_ptr participant)
+  // The leave function removes a participant from its room and frees its
+  // session id. A session can fail on its read and its write side, so leaving
+  // twice is harmless. Returns false if it had already left.
+  bool leave(chat_participant_ptr participant)
   {
-    participants_.erase(participant);
+    std::lock_guard<std::mutex> lock(mutex_);
+    session_id id = participant->id;
+    if(id == no_session || sessions_[id] != participant) {
+      return false;
+    }
+    remove_member(rooms_[participant->get_room()], id);
+    names_.release(participant->get_name(), id);
+    sessions_[id].reset();
+    free_ids_.push_back(id);
+    participant->id = no_session;
+    return true;
   }
 
   // The create_room function takes a string [room_name] as a parameter and
-  // creates a new entry in the map [sub_room] so that a new room is created.
-  void create_room(std::string room_name) {
-    // creates an empty vector
-    std::vector<std::string> empty_vector;
-    // creates an entry with the [room_name] parameter in the map and makes its
-    // value an empty vector.
-    sub_rooms[room_name].swap(empty_vector);
-    chat_message_queue recent_msgs_;
-    msg_queue_[room_name] = recent_msgs_;
-    if(DEBUG_MODE)
-      std::cout << room_name << ": created" << std::endl;
+  // creates a new entry in [rooms_] so that a new room is created.
+  // Returns false without touching anything if the room already exists, so
+  // two sessions racing to create the same room cannot wipe its history.
+  bool create_room(std::string room_name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(room_name.size() > room_log::max_room_name) {
+      CHAT_LOG(log_warn) << "not creating a room with a " << room_name.size()
+        << " byte name";
+      return false;
+    }
+    if(room_ids_.count(room_name)) {
+      return false;
+    }
+    add_room(room_name);
+    if(log_)
+      log_->append_room(room_name);
+    CHAT_LOG(log_info) << room_name << ": created";
+    return true;
   }
 
   // The check_room function takes a string [name_to_check] as a parameter
-  // and searches the [sub_rooms] map to see if a room already exists with
+  // and searches the [room_ids_] index to see if a room already exists with
   // the name that was passed and returns a boolean value.
   bool check_room(std::string name_to_check) {
-    if (sub_rooms.find(name_to_check) != sub_rooms.end()) {
-      return true;
-    } else {
-      return false;
-    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    return room_ids_.count(name_to_check) != 0;
+  }
+
+  // The room_name function returns the name of the room with id [id].
+  std::string room_name(room_id id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return rooms_[id].name;
   }
 
   // The join_room function takes a chat_participant_ptr [part] and a string
   // [name_to_check] as parameters. It uses checks to see if a room exists
   // before it tries to joining a room with the participant pointer it received
-  // [part].
-  void join_room(chat_participant_ptr part, std::string name_to_check) {
-    if(check_room(name_to_check)) {
-      part->set_room(name_to_check);
-      sub_rooms[name_to_check].push_back(part->get_uuid());
-      for (auto msg: msg_queue_[name_to_check])
-        part->deliver(msg);
-    }
-  }
-
-  // The update_messages function takes a chat_participant_ptr [part] as a
-  // parameter and looks for the differences between messages it has already been
-  // sent and the vector in the [sub_rooms] map which stores all the messages
-  // sent to a certain chat room. Then it formats any messages which have not yet
-  // been sent to the user in a single string with the format specified by the
-  // requirements and returns this string [line].
-  std::string update_messages(chat_participant_ptr part) {
-    std::string line = "";
-    std::string room = part->get_room();
-    if (part->get_sent().size() < msg_queue_[room].size()) {
-      int max = msg_queue_[room].size();
-      int start = part->get_sent().size();
-      for(int i = start; i < max; i++) {
-        line = line + std::string(msg_queue_[room][i].body()).substr(0, msg_queue_[room][i].body_length());
-        part->send_text(msg_queue_[room][i]);
-      }
+  // [part]. Returns whether the room was joined.
+  bool join_room(chat_participant_ptr part, std::string name_to_check) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = room_ids_.find(name_to_check);
+    if(found == room_ids_.end()) {
+      return false;
     }
-    return line;
+    room_state& room = rooms_[found->second];
+    // a session joining the room it is in, as every new one does with the
+    // lobby, stays put instead of leaving and joining again
+    if(part->id != no_session && part->get_room() != found->second) {
+      remove_member(rooms_[part->get_room()], part->id);
+      add_member(room, part->id);
+    }
+    part->set_room(found->second);
+    CHAT_LOG(log_debug) << part->get_uuid() << " joined: " << room.name;
+    // Subscribed users get the history through push_messages once the
+    // CHANGECHATROOM reply has gone out, so their client does not clear it.
+    if(!part->is_subscribed()) {
+      const room_history& history = room.history;
+      std::vector<chat_message_ptr> frames;
+      frames.reserve(history.size());
+      for (std::size_t seq = history.first_seq(); seq < history.end_seq(); seq++)
+        frames.push_back(history.at(seq));
+      deliver_backlog(part, frames, options_.max_page_bytes);
+    }
+    return true;
+  }
+
+  // The update_messages function takes a chat_participant_ptr [part] and a
+  // resume token [resume] as parameters and collects the next page of
+  // messages of its room, from the participant's cursor or from [resume] if
+  // that is further on. It formats them in a single string with the format
+  // specified by the requirements, moves the cursor past them and returns
+  // this string [line].
+  std::string update_messages(chat_participant_ptr part, std::size_t resume = 0) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(resume > part->get_cursor()) {
+      std::size_t end = rooms_[part->get_room()].history.end_seq();
+      part->set_cursor(resume < end ? resume : end);
+    }
+    return unsent_messages(part);
+  }
+
+  // The push_messages function sends the next page of what [part] has not seen
+  // yet in its room as a REQTEXT reply, the same frame a poll would have returned.
+  void push_messages(chat_participant_ptr part) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    push_unsent(part);
   }
 
   // The deliver function is used to send server replies to a participant.
-  void deliver(chat_participant_ptr part, const chat_message& msg)
+  // Subscribed members of the room have the new message pushed to them,
+  // everybody else keeps the old behaviour and picks it up with REQTEXT.
+  // Every member gets the same frame: [msg] itself, or one REQTEXT built for
+  // all subscribers that had already read everything before [msg].
+  void deliver(chat_participant_ptr part, const chat_message_ptr& msg)
   {
-    std::string rm = part->get_room();
-    msg_queue_[rm].push_back(msg);
-    //while (msg_queue_[rm].size() > max_recent_msgs)
-    //  msg_queue_[rm].pop_front();
+    std::lock_guard<std::mutex> lock(mutex_);
+    room_state& room = rooms_[part->get_room()];
+    room_history& history = room.history;
+    // the history evicts its oldest messages once it is over its limits
+    history.push_back(msg);
+    std::size_t seq = history.end_seq() - 1;
+    if(log_) {
+      unsigned int segment = log_->append_message(room.name, msg->body(),
+          msg->body_length());
+      note_segment(room, seq, segment);
+      if(segment > log_segment_) {
+        log_segment_ = segment;
+        release_segments();
+      }
+    }
 
-    for (auto participant: participants_)
-      if(part->get_room() == participant->get_room())
+    // one shared REQTEXT per checksum kind in use
+    chat_message_ptr pushed[2];
+    for (session_id id: room.members) {
+      const chat_participant_ptr& participant = sessions_[id];
+      if(!participant->is_subscribed()) {
         participant->deliver(msg);
+      } else if(participant->get_cursor() == seq
+          && msg->body_length() <= page_budget(participant)) {
+        checksum_kind kind = participant->get_checksum();
+        if(!pushed[kind]) {
+          pushed[kind] = make_request_message("REQTEXT",
+              boost::string_view(msg->body(), msg->body_length()), kind);
+        }
+        participant->set_cursor(seq + 1);
+        participant->deliver(pushed[kind]);
+      } else {
+        push_unsent(participant);
+      }
+    }
   }
-  void reply(chat_participant_ptr part, const chat_message& msg) {
+  void reply(chat_participant_ptr part, const chat_message_ptr& msg) {
     part->deliver(msg);
   }
 
   // The list_users function takes a participant pointer [partic] as a parameter
   // and returns a list of all users in a chat room in a single string [line].
   std::string list_users(chat_participant_ptr partic) {
+    std::lock_guard<std::mutex> lock(mutex_);
     std::string list;
-    for (auto part: participants_) {
-      if(partic->get_room() == part->get_room()) {
-        list += (part->get_uuid()+ "," + part->get_name() + ";");
-      }
+    for (session_id id: rooms_[partic->get_room()].members) {
+      list += (sessions_[id]->get_uuid()+ "," + sessions_[id]->get_name() + ";");
     }
     return list;
   }
 
-  // The list_rooms function takes a participant pointer [partic] as a parameter
-  // and returns a list of all chat rooms in a single string [list].
-  std::string list_rooms() {
+  // The list_queues function returns the outbound queue of every connected
+  // user as "uuid,frames,bytes,peak frames,dropped;" in a single string.
+  std::string list_queues() {
+    std::lock_guard<std::mutex> lock(mutex_);
     std::string list;
-    for (const auto &str : sub_rooms ) {
-      list += (str.first+";");
+    for (const auto& part: sessions_) {
+      if(part) {
+        queue_stats q = part->get_queue_stats();
+        list += part->get_uuid() + "," + std::to_string(q.frames) + ","
+          + std::to_string(q.bytes) + "," + std::to_string(q.peak_frames) + ","
+          + std::to_string(q.dropped) + ";";
+      }
     }
     return list;
   }
 
-  // Takes a string [name_to_check] as a parameter and checks all users to see
-  // if their desired username already exists in the list of users.
-  bool check_name(std::string name_to_check) {
-    for (auto part: participants_) {
-      if(part->get_name() == name_to_check) {
-        return true;
+  // The list_rooms function returns a list of all chat rooms in a single
+  // string, sorted by name. The list only changes when a room is created, so
+  // it is rebuilt then and reused until the next one.
+  std::string list_rooms() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(room_list_stale_) {
+      std::vector<const std::string*> names;
+      for (const room_state& room: rooms_) {
+        names.push_back(&room.name);
+      }
+      std::sort(names.begin(), names.end(),
+          [](const std::string* a, const std::string* b) { return *a < *b; });
+      room_list_.clear();
+      for (const std::string* room_name: names) {
+        room_list_ += (*room_name + ";");
+      }
+      room_list_stale_ = false;
+    }
+    return room_list_;
+  }
+
+  // The append_stats function adds the gauges of the rooms and sessions to
+  // the stats report [out]: how many rooms and connected sessions there are,
+  // the messages and bytes kept in all histories, and the frames and bytes
+  // waiting in all outbound queues, the longest queue and the frames dropped.
+  void append_stats(std::string& out) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::size_t messages = 0, message_bytes = 0;
+    for (const room_state& room: rooms_) {
+      messages += room.history.size();
+      message_bytes += room.history.bytes();
+    }
+    queue_stats total, longest;
+    for (const auto& part: sessions_) {
+      if(part) {
+        queue_stats q = part->get_queue_stats();
+        total.frames += q.frames;
+        total.bytes += q.bytes;
+        total.dropped += q.dropped;
+        if(q.frames > longest.frames)
+          longest = q;
       }
     }
-    return false;
+    append_stat(out, "rooms", rooms_.size());
+    append_stat(out, "sessions.active", sessions_.size() - free_ids_.size());
+    append_stat(out, "store.messages", messages);
+    append_stat(out, "store.bytes", message_bytes);
+    append_stat(out, "queue.frames", total.frames);
+    append_stat(out, "queue.bytes", total.bytes);
+    append_stat(out, "queue.max_frames", longest.frames);
+    append_stat(out, "queue.dropped", total.dropped);
+    if(log_)
+      append_stat(out, "log.failures", log_->failures());
+  }
+
+  // The update_member function tells the other members of [part]'s room
+  // that its uuid or name changed.
+  void update_member(chat_participant_ptr part) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(part->id != no_session) {
+      record_presence(rooms_[part->get_room()], part->id, true);
+    }
+  }
+
+  // The users_since function collects what changed in the member list of
+  // [part]'s room since the version in [since], a token from an earlier
+  // reply, as "+<session>,<uuid>,<name>;" for members that joined or changed
+  // and "-<session>;" for members that left. A token from another room, or
+  // one older than the changes the room remembers, gets the whole list
+  // instead, after a "=;" that tells the client to forget what it has. The
+  // entries are split into [pages] of about [budget] bytes and [token] is
+  // set to the current version. Returns false, with no pages, if nothing
+  // changed.
+  bool users_since(chat_participant_ptr part, boost::string_view since,
+      std::size_t budget, std::string& token, std::vector<std::string>& pages) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    room_id id = part->get_room();
+    const room_state& room = rooms_[id];
+    token = std::to_string(id) + "." + std::to_string(room.members_version);
+    unsigned int since_room;
+    unsigned long long since_version;
+    bool known = std::sscanf(std::string(since).c_str(), "%u.%llu", &since_room,
+        &since_version) == 2 && since_room == id
+      && since_version <= room.members_version;
+    if(known && since_version == room.members_version) {
+      return false;
+    }
+    if(known && !room.presence.empty()
+        && room.presence.front().version <= since_version + 1) {
+      // only the last change of each session matters to the client
+      std::size_t first = since_version + 1 - room.presence.front().version;
+      std::unordered_map<session_id, std::size_t> last;
+      for(std::size_t i = first; i < room.presence.size(); i++) {
+        last[room.presence[i].id] = i;
+      }
+      for(std::size_t i = first; i < room.presence.size(); i++) {
+        const presence_event& event = room.presence[i];
+        if(last[event.id] != i) {
+          continue;
+        }
+        add_entry(pages, event.joined
+            ? member_entry(event.id, event.uuid, event.name)
+            : "-" + std::to_string(event.id) + ";", budget);
+      }
+    } else {
+      add_entry(pages, "=;", budget);
+      for(session_id member: room.members) {
+        const chat_participant_ptr& p = sessions_[member];
+        add_entry(pages, member_entry(member, p->get_uuid(), p->get_name()), budget);
+      }
+    }
+    return true;
+  }
+
+  // The rooms_since function does the same for the list of rooms. Rooms are
+  // never removed, so the version is the number of rooms and the changes
+  // since [since] are the rooms created after it, as "+<name>;". A token of
+  // 0 or one the server does not know gets the whole list after "=;".
+  bool rooms_since(boost::string_view since, std::size_t budget,
+      std::string& token, std::vector<std::string>& pages) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    token = std::to_string(rooms_.size());
+    std::size_t first = std::strtoull(std::string(since).c_str(), NULL, 10);
+    if(first == rooms_.size()) {
+      return false;
+    }
+    if(first == 0 || first > rooms_.size()) {
+      first = 0;
+      add_entry(pages, "=;", budget);
+    }
+    for(std::size_t i = first; i < rooms_.size(); i++) {
+      add_entry(pages, "+" + rooms_[i].name + ";", budget);
+    }
+    return true;
+  }
+
+  // Takes a string [name_to_check] as a parameter and checks the registry of
+  // nicknames to see if their desired username is already in use.
+  bool check_name(std::string name_to_check) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return names_.taken(name_to_check);
+  }
+
+  // The claim_name function gives the participant [part] the nickname
+  // [name_to_claim], or a free one made from it if somebody else has it, and
+  // returns the name it got. The registry and the participant are updated
+  // under one lock so two sessions cannot end up with the same name. Returns
+  // an empty string for an empty name or a participant that has left.
+  std::string claim_name(chat_participant_ptr part, std::string name_to_claim) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(part->id == no_session || name_to_claim.empty()) {
+      return "";
+    }
+    std::string given = name_to_claim;
+    if(!names_.claim(given, part->id)) {
+      given = names_.suggest(name_to_claim);
+      names_.claim(given, part->id);
+    }
+    std::string old_name = part->get_name();
+    if(old_name != given) {
+      names_.release(old_name, part->id);
+    }
+    part->set_name(given);
+    record_presence(rooms_[part->get_room()], part->id, true);
+    return given;
   }
 
   // A getter to return the name of this chat_room
@@ -254,39 +721,253 @@ public:
     return name;
   }
 
+  // The split_pages function splits a list of ';' terminated entries, such
+  // as the stats report, into pages of whole entries of at most [budget]
+  // bytes. A last entry without its ';' still counts as one.
+  static std::vector<std::string> split_pages(const std::string& list,
+      std::size_t budget) {
+    std::vector<std::string> pages;
+    std::size_t pos = 0;
+    while(pos < list.size()) {
+      std::size_t semi = list.find(';', pos);
+      std::size_t end = semi == std::string::npos ? list.size() : semi + 1;
+      add_entry(pages, list.substr(pos, end - pos), budget);
+      pos = end;
+    }
+    if(pages.empty()) {
+      pages.push_back("");
+    }
+    return pages;
+  }
+
 private:
+  // One change to the members of a room: session [id] joined or got a new
+  // uuid or name ([joined] set, with what it has now), or left.
+  struct presence_event
+  {
+    std::uint64_t version;
+    session_id id;
+    bool joined;
+    std::string uuid;
+    std::string name;
+  };
+
+  // How many member changes each room remembers for USERSDELTA; clients
+  // further behind get the whole list.
+  enum { max_presence_events = 256 };
+
+  // Everything a room keeps: its name, the ids of the sessions in it, its
+  // recent messages, the log segments they are stored in, and the version
+  // of its member list with the changes that led up to it.
+  struct room_state
+  {
+    room_state(const std::string& room_name, const server_options& options)
+      : name(room_name),
+        history(options.max_recent_msgs, options.max_recent_bytes),
+        members_version(0)
+    {
+    }
+
+    std::string name;
+    std::vector<session_id> members;
+    room_history history;
+    // (first sequence number, segment) for each log segment the messages
+    // still in [history] went to, oldest first
+    std::deque<std::pair<std::size_t, unsigned int>> log_segments;
+    std::uint64_t members_version;
+    std::deque<presence_event> presence;
+  };
+
+  // Unlocked helpers, callers must already hold [mutex_].
+  room_id add_room(const std::string& room_name) {
+    room_id id = rooms_.size();
+    rooms_.emplace_back(room_name, options_);
+    room_ids_.emplace(room_name, id);
+    room_list_stale_ = true;
+    return id;
+  }
+
+  room_id find_or_add_room(const std::string& room_name) {
+    auto found = room_ids_.find(room_name);
+    return found != room_ids_.end() ? found->second : add_room(room_name);
+  }
+
+  // Members are kept unordered; [member_slot_] remembers where each session
+  // sits in its room's list so it can be swapped out in O(1).
+  void add_member(room_state& room, session_id id) {
+    member_slot_[id] = room.members.size();
+    room.members.push_back(id);
+    record_presence(room, id, true);
+  }
+
+  void remove_member(room_state& room, session_id id) {
+    session_id last = room.members.back();
+    room.members[member_slot_[id]] = last;
+    member_slot_[last] = member_slot_[id];
+    room.members.pop_back();
+    record_presence(room, id, false);
+  }
+
+  // Remembers that the message [seq] of [room] went to log [segment].
+  static void note_segment(room_state& room, std::size_t seq, unsigned int segment) {
+    if(segment != 0 && (room.log_segments.empty()
+          || room.log_segments.back().second != segment)) {
+      room.log_segments.push_back(std::make_pair(seq, segment));
+    }
+  }
+
+  // Deletes the log segments none of the rooms keeps messages from any
+  // more. Runs each time the log starts a new segment; every segment starts
+  // with the rooms, so only messages keep one alive.
+  void release_segments() {
+    unsigned int needed = log_segment_;
+    for(room_state& room: rooms_) {
+      std::deque<std::pair<std::size_t, unsigned int>>& segments = room.log_segments;
+      // a segment is done with once the history starts past its messages
+      while(segments.size() > 1 && segments[1].first <= room.history.first_seq()) {
+        segments.pop_front();
+      }
+      if(!segments.empty() && room.history.size() > 0) {
+        needed = std::min(needed, segments.front().second);
+      }
+    }
+    log_->drop_before(needed);
+  }
+
+  // Bumps the version of the member list of [room] and remembers that
+  // session [id] joined (or changed) or left.
+  void record_presence(room_state& room, session_id id, bool joined) {
+    presence_event event;
+    event.version = ++room.members_version;
+    event.id = id;
+    event.joined = joined;
+    if(joined) {
+      event.uuid = sessions_[id]->get_uuid();
+      event.name = sessions_[id]->get_name();
+    }
+    room.presence.push_back(event);
+    if(room.presence.size() > max_presence_events) {
+      room.presence.pop_front();
+    }
+  }
+
+  static std::string member_entry(session_id id, const std::string& uuid,
+      const std::string& name) {
+    return "+" + std::to_string(id) + "," + uuid + "," + name + ";";
+  }
+
+  // Appends [entry] to the last of [pages], or starts a new page if it would
+  // go over [budget] bytes.
+  static void add_entry(std::vector<std::string>& pages, const std::string& entry,
+      std::size_t budget) {
+    if(pages.empty() || (!pages.back().empty()
+          && pages.back().size() + entry.size() > budget)) {
+      pages.push_back("");
+    }
+    pages.back() += entry;
+  }
+
+  // Messages evicted before the participant read them are skipped, the
+  // cursor continues from the oldest message still in the history.
+  // One call returns one page, whole messages up to page_budget() bytes; a
+  // message too big for a v1 page on its own comes as a notice instead. If
+  // more are waiting the page ends in "+<token>" after the last message's ';',
+  // where token is the sequence number to continue from with REQTEXT,<token>.
+  // Clients that do not know the marker ignore it like any text after the
+  // last ';' and get the next page with their next poll.
+  std::string unsent_messages(const chat_participant_ptr& part) {
+    std::string line = "";
+    const room_history& history = rooms_[part->get_room()].history;
+    std::size_t next = history.fitted_page(part->get_cursor(), page_budget(part), line);
+    part->set_cursor(next);
+    if(next < history.end_seq()) {
+      line += "+" + std::to_string(next);
+    }
+    return line;
+  }
+
+  std::size_t page_budget(const chat_participant_ptr& part) {
+    if(part->get_protocol() == 2) {
+      return options_.max_page_bytes;
+    }
+    return room_history::v1_page_bytes;
+  }
+
+  void push_unsent(const chat_participant_ptr& part) {
+    std::string line = unsent_messages(part);
+    if(line != "")
+      deliver_backlog(part, { make_request_message("REQTEXT", line,
+            part->get_checksum()) }, options_.max_page_bytes);
+  }
+
+  // Guards all of the room state below
+  std::mutex mutex_;
   // Name of this chat room
   std::string name;
-  // A list of pointers to all chat participants
-  std::set<chat_participant_ptr>  participants_;
-  // A map of all rooms created by users with a string as the key [the name of the room]
-  // and a vector as the value [list of all messages]
-  std::map<std::string, std::vector<std::string>> sub_rooms;
-  // Max recent messages
-  enum { max_recent_msgs = 10000000 };
-  // A queue of all messages sent to the server recently
-  std::map<std::string, chat_message_queue> msg_queue_;
+  // Where new rooms and messages are recorded, NULL when not persisting
+  room_log* log_;
+  // the newest log segment a message went to
+  unsigned int log_segment_;
+  // Every room, indexed by its room_id
+  std::vector<room_state> rooms_;
+  // The id of every room by name, for the requests that name a room
+  std::unordered_map<std::string, room_id> room_ids_;
+  // Every connected participant, indexed by its session_id; freed ids hold
+  // an empty pointer until [free_ids_] hands them out again
+  std::vector<chat_participant_ptr> sessions_;
+  std::vector<session_id> free_ids_;
+  // The position of every session in its room's [members]
+  std::vector<std::size_t> member_slot_;
+  // The nickname of every session that has one
+  name_registry names_;
+  // Limits on how much history each room keeps
+  server_options options_;
+  // The REQCHATROOMS reply, rebuilt after a room is created
+  std::string room_list_;
+  bool room_list_stale_;
 };
 
 //----------------------------------------------------------------------
 
 /*
   chat_session class
+  Every handler of a session runs through its [strand_], so a session is never
+  touched by two pool threads at once even though the io_service is shared.
 */
 class chat_session
   : public chat_participant,
     public std::enable_shared_from_this<chat_session>
 {
 public:
-  chat_session(tcp::socket socket, chat_room& room)
+  chat_session(boost::asio::io_service& io_service, tcp::socket socket,
+      chat_room& room, const server_options& options, server_metrics& metrics)
     : socket_(std::move(socket)),
-      room_(room)
+      strand_(io_service),
+      room_(room),
+      options_(options),
+      metrics_(metrics),
+      protocol_(1),
+      writing_(0),
+      queued_bytes_(0),
+      marker_pending_(false),
+      missed_(0),
+      closing_(false),
+      admin_(false),
+      stat_frames_(0),
+      stat_bytes_(0),
+      stat_peak_(0),
+      stat_dropped_(0)
   {
   }
 
   // The initial actions of the server with a new client session.
   void start()
   {
+    metrics_.sessions_opened.fetch_add(1, std::memory_order_relaxed);
+    // Without a token the admin commands are open to local clients only.
+    boost::system::error_code ec;
+    tcp::endpoint peer = socket_.remote_endpoint(ec);
+    admin_ = options_.admin_token.empty() && !ec && peer.address().is_loopback();
     // User joins the list of users
     room_.join(shared_from_this());
     // User joins the list of users in "the lobby" key of the map.
@@ -295,218 +976,570 @@ public:
     do_read_header();
   }
 
-  // Deliver communications to the client
-  void deliver(const chat_message& msg)
+  // Deliver communications to the client. This is called from other sessions
+  // during a room fan-out, so the queue is only touched from our strand.
+  void deliver(const chat_message_ptr& msg)
   {
-    bool write_in_progress = !write_msgs_.empty();
-    write_msgs_.push_back(msg);
-    if (!write_in_progress)
-    {
-      do_write();
-    }
+    auto self(shared_from_this());
+    strand_.post(
+        [this, self, msg]()
+        {
+          if (closing_)
+            return;
+          bool write_in_progress = !write_msgs_.empty();
+          write_msgs_.push_back(msg);
+          queued_bytes_ += msg->body_length();
+          limit_queue();
+          update_queue_stats();
+          if (!write_in_progress && !closing_)
+          {
+            do_write();
+          }
+        });
+  }
+
+  // Readable from any thread, the counters are updated from the strand
+  queue_stats get_queue_stats() const
+  {
+    queue_stats stats;
+    stats.frames = stat_frames_;
+    stats.bytes = stat_bytes_;
+    stats.peak_frames = stat_peak_;
+    stats.dropped = stat_dropped_;
+    return stats;
+  }
+
+  // The stats_report function returns everything [metrics] and [room] count
+  // as "key=value;" pairs: the traffic totals, the gauges of the rooms and a
+  // latency summary in nanoseconds for every command that was handled.
+  static std::string stats_report(chat_room& room, const server_metrics& metrics)
+  {
+    std::string out;
+    append_stat(out, "frames.in", metrics.frames_in);
+    append_stat(out, "bytes.in", metrics.bytes_in);
+    append_stat(out, "frames.out", metrics.frames_out);
+    append_stat(out, "bytes.out", metrics.bytes_out);
+    append_stat(out, "sessions.total", metrics.sessions_opened);
+    append_stat(out, "sessions.closed", metrics.sessions_closed);
+    append_stat(out, "errors.checksum", metrics.bad_checksums);
+    append_stat(out, "errors.unknown_command", metrics.unknown_commands);
+    append_stat(out, "errors.refused_command", metrics.refused_commands);
+    room.append_stats(out);
+    const std::vector<command_entry>& table = commands();
+    for (std::size_t i = 0; i < table.size() && i < server_metrics::max_commands; ++i)
+      if (metrics.commands[i].count() > 0)
+        append_histogram(out, "cmd." + std::string(table[i].name),
+            metrics.commands[i]);
+    return out;
   }
 
 private:
-  void do_read_header()
+  // Reads the header of the next frame. A v1 header is complete after
+  // header_length bytes, a v2 header may need a few more for its varint.
+  void do_read_header(std::size_t have = 0)
   {
     auto self(shared_from_this());
+    std::size_t want = have == 0 ? std::size_t(chat_message::header_length)
+      : read_msg_.missing_header_bytes(have);
     boost::asio::async_read(socket_,
-        boost::asio::buffer(read_msg_.data(), chat_message::header_length),
-        [this, self](boost::system::error_code ec, std::size_t /*length*/)
+        boost::asio::buffer(read_msg_.header_buffer() + have, want),
+        strand_.wrap([this, self, have, want](boost::system::error_code ec, std::size_t /*length*/)
         {
-          if (!ec && read_msg_.decode_header())
+          if (!ec && read_msg_.missing_header_bytes(have + want) > 0)
+          {
+            do_read_header(have + want);
+          }
+          else if (!ec && read_msg_.decode_header(have + want))
           {
+            // a client that talks v2 to us understands v2 replies
+            if (read_msg_.version() == 2 && protocol_ != 2)
+            {
+              protocol_ = 2;
+              set_protocol(2);
+            }
             do_read_body();
           }
           else
           {
-            room_.leave(shared_from_this());
+            leave_room();
           }
-        });
+        }));
+  }
+
+  // Encodes a reply for [command] with [data] and queues it for the client.
+  void reply(boost::string_view command, boost::string_view data)
+  {
+    room_.reply(shared_from_this(), make_request_message(command, data,
+          get_checksum()));
   }
 
   // In this function, the body of the communications from the client are parsed.
+  // The line is split into views over [read_msg_] and the command is looked
+  // up in the table of handlers, so neither step allocates.
   void do_read_body()
   {
     auto self(shared_from_this());
     boost::asio::async_read(socket_, boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
-        [this, self](boost::system::error_code ec, std::size_t /*length*/)
+        strand_.wrap([this, self](boost::system::error_code ec, std::size_t /*length*/)
         {
           if (!ec)
           {
-            // We create a string [read_line] with the length received in the header.
-            std::string read_line = std::string(read_msg_.body()).substr(0, read_msg_.body_length());
-            if(DEBUG_MODE)
-              std::cout << read_line << std::endl;
+            metrics_.frames_in.fetch_add(1, std::memory_order_relaxed);
+            metrics_.bytes_in.fetch_add(read_msg_.body_length()
+                + (read_msg_.version() == 2 ? read_msg_.v2_header_length()
+                  : std::size_t(chat_message::header_length)),
+                std::memory_order_relaxed);
+            // A view [read_line] over the body with the length received in the header.
+            boost::string_view read_line(read_msg_.body(), read_msg_.body_length());
+            CHAT_LOG_SAMPLED(log_trace) << read_line;
+            command_line cmd;
             // If we are concerned with correct checksums and the checksum is correct
             // proceed.
-            if(CHECKSUM_VALIDATION && checkCheckSum(read_line.c_str())) {
-              //creating a vector that will store all of the splits of the data
-              std::vector<std::string> strs;
-              //splitting [read_line] on any ',' or ' ' character
-              boost::split(strs, read_line, boost::is_any_of(", "));
-              //loop through the vector and delete and empty indexes.
-              for(unsigned int i = 0; i < strs.size(); i++) {
-                if(strs[i] == "") {
-                  strs.erase(strs.begin()+i);
-                }
-              }
-              // The command that we receive will always be located in index
-              // 2 of the vector, use this to determine how to handle the data.
-              if(strs[2] == "MYUUID") {
-                if(DEBUG_MODE)
-                  std::cout << shared_from_this()->get_uuid() << std::endl;
-              } else if(strs[2] == "REQCHATROOM") {
-                // A string which will be used to store the users room.
-                std::string s = shared_from_this()->get_room();
-                /* Format the reply and send it with the reply method */
-                s = format_request("REQCHATROOM", s);
-                char response[chat_message::max_body_length + 1];
-                std::strcpy(response, s.c_str());
-                chat_message res;
-                res.body_length(std::strlen(response));
-                std::memcpy(res.body(), response, res.body_length());
-                res.encode_header();
-                room_.reply(shared_from_this(), res);
-              } else if(strs[2] == "REQUUID") {
-                std::string s = gen_uuid();
-                shared_from_this()->set_uuid(s);
-                if(DEBUG_MODE)
-                  std::cout << shared_from_this()->get_uuid() << ": Connected" << std::endl;
-                char response[chat_message::max_body_length + 1];
-                s = format_request("REQUUID", s);
-                std::strcpy(response, s.c_str());
-                chat_message res;
-                res.body_length(std::strlen(response));
-                std::memcpy(res.body(), response, res.body_length());
-                res.encode_header();
-                room_.reply(shared_from_this(), res);
-              } else if(strs[2] == "NICK") {
-                std::string m = build_optional_line(strs, 3);
-                if(!room_.check_name(m)) {
-                  shared_from_this()->set_name(m);
-                  char response[chat_message::max_body_length + 1];
-                  std::string s = format_request("NICK", m);
-                  std::strcpy(response, s.c_str());
-                  chat_message res;
-                  res.body_length(std::strlen(response));
-                  std::memcpy(res.body(), response, res.body_length());
-                  res.encode_header();
-                  room_.reply(shared_from_this(), res);
-                } else {
-                  //TODO: Modify to ensure uniqueness if necessary
-                }
-                /**
-                * Need to create a new "message" that will actually be stored with the form:
-                * UUID MESSAGE
-                */
-              } else if(strs[2] == "SENDTEXT") {
-                if(shared_from_this()->get_room() != "") {
-                  std::string m = build_optional_line(strs, 3);
-                  char uuid_message[chat_message::max_body_length + 1];
-                  std::strcpy(uuid_message, shared_from_this()->get_uuid().c_str());
-                  std::strcat(uuid_message, " ");
-                  std::strcat(uuid_message, m.c_str());
-                  std::strcat(uuid_message, ";");
-                  chat_message store_msg;
-                  store_msg.body_length(std::strlen(uuid_message));
-                  std::memcpy(store_msg.body(), uuid_message, store_msg.body_length());
-                  store_msg.encode_header();
-                  room_.deliver(shared_from_this(), store_msg);
-                  char response[chat_message::max_body_length + 1];
-                  std::strcpy(response, std::to_string(m.length()).c_str());
-                  std::strcat(response, "[");
-                  std::strcat(response, m.c_str());
-                  std::strcat(response, "];");
-                  std::string s = format_request("SENDTEXT", std::string(response));
-                  std::strcpy(response, s.c_str());
-                  chat_message res;
-                  res.body_length(std::strlen(response));
-                  std::memcpy(res.body(), response, res.body_length());
-                  res.encode_header();
-                  room_.reply(shared_from_this(), res);
-                }
-              } else if(strs[2] == "NAMECHATROOM") {
-                std::string m = build_optional_line(strs, 3);
-                if(!room_.check_room(m)) {
-                  room_.create_room(m);
-                  char response[chat_message::max_body_length + 1];
-                  std::string s = format_request("NAMECHATROOM", m);
-                  std::strcpy(response, s.c_str());
-                  chat_message res;
-                  res.body_length(std::strlen(response));
-                  std::memcpy(res.body(), response, res.body_length());
-                  res.encode_header();
-                  room_.reply(shared_from_this(), res);
-                }
-              } else if(strs[2] == "CHANGECHATROOM") {
-                std::string m = build_optional_line(strs, 3);
-                if(room_.check_room(m)) {
-                  room_.join_room(shared_from_this(), m);
-                  char response[chat_message::max_body_length + 1];
-                  std::string s = format_request("CHANGECHATROOM", m);
-                  std::strcpy(response, s.c_str());
-                  chat_message res;
-                  res.body_length(std::strlen(response));
-                  std::memcpy(res.body(), response, res.body_length());
-                  res.encode_header();
-                  room_.reply(shared_from_this(), res);
-                }
-              } else if(strs[2] == "REQUSERS") {
-                std::string users = room_.list_users(shared_from_this());
-                char response[chat_message::max_body_length + 1];
-                std::string s = format_request("REQUSERS", users);
-                std::strcpy(response, s.c_str());
-                chat_message res;
-                res.body_length(std::strlen(response));
-                std::memcpy(res.body(), response, res.body_length());
-                res.encode_header();
-                room_.reply(shared_from_this(), res);
-              } else if(strs[2] == "REQCHATROOMS") {
-                std::string rms = room_.list_rooms();
-                char response[chat_message::max_body_length + 1];
-                std::string s = format_request("REQCHATROOMS", rms);
-                std::strcpy(response, s.c_str());
-                chat_message res;
-                res.body_length(std::strlen(response));
-                std::memcpy(res.body(), response, res.body_length());
-                res.encode_header();
-                room_.reply(shared_from_this(), res);
-              } else if(strs[2] == "REQTEXT") {
-                char response[chat_message::max_body_length + 1];
-                std::string data = room_.update_messages(shared_from_this());
-                std::string s = format_request("REQTEXT", data);
-                std::strcpy(response, s.c_str());
-                //std::cout << s << "!!!!" << std::endl;
-                chat_message res;
-                res.body_length(std::strlen(response));
-                std::memcpy(res.body(), response, res.body_length());
-                res.encode_header();
-                room_.reply(shared_from_this(), res);
+            if(!parse_command(read_line, cmd)) {
+              CHAT_LOG(log_error) << "Missing command";
+            } else if(CHECKSUM_VALIDATION && checksum_ok()) {
+              const command_entry* entry = find_command(cmd.command);
+              if(entry && entry->admin && !admin_) {
+                CHAT_LOG(log_warn) << "Refused " << cmd.command
+                  << " from a client that is not an admin";
+                metrics_.refused_commands.fetch_add(1, std::memory_order_relaxed);
+              } else if(entry) {
+                std::chrono::steady_clock::time_point start =
+                  std::chrono::steady_clock::now();
+                (this->*(entry->handler))(cmd.args);
+                std::size_t index = entry - &commands()[0];
+                if(index < server_metrics::max_commands)
+                  metrics_.commands[index].record(
+                      std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count());
+              } else {
+                metrics_.unknown_commands.fetch_add(1, std::memory_order_relaxed);
               }
             } else {
-              std::cout << "ERROR: Invald checksum" << std::endl;
+              metrics_.bad_checksums.fetch_add(1, std::memory_order_relaxed);
+              CHAT_LOG(log_error) << "Invalid checksum";
             }
             do_read_header();
           }
           else
           {
-            room_.leave(shared_from_this());
+            leave_room();
           }
-        });
+        }));
+  }
+
+  // Called when the read or the write side fails; the session is counted as
+  // closed once, whichever comes first.
+  void leave_room()
+  {
+    if(room_.leave(shared_from_this()))
+      metrics_.sessions_closed.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Checks the checksum of the line in [read_msg_] against the kind this
+  // session agreed on. Lines the client sent before it saw the CHECKSUM
+  // acknowledgement still carry crc32, so that is accepted too.
+  bool checksum_ok()
+  {
+    checksum_kind kind = get_checksum();
+    return verify_checksum(read_msg_.body(), read_msg_.body_length(), kind)
+      || (kind != checksum_crc32
+          && verify_checksum(read_msg_.body(), read_msg_.body_length()));
+  }
+
+  typedef void (chat_session::*command_handler)(boost::string_view args);
+
+  struct command_entry
+  {
+    boost::string_view name;
+    command_handler handler;
+    // only answered for a session that is an admin, see handle_admin
+    bool admin;
+  };
+
+  // The commands function returns the table of every command the server
+  // knows, its handler and whether it is for admins only. A command's
+  // position in the table is also its index into server_metrics::commands.
+  static const std::vector<command_entry>& commands()
+  {
+    static const std::vector<command_entry> table = {
+      { "REQTEXT", &chat_session::handle_reqtext, false },
+      { "SENDTEXT", &chat_session::handle_sendtext, false },
+      { "REQUSERS", &chat_session::handle_requsers, false },
+      { "REQCHATROOMS", &chat_session::handle_reqchatrooms, false },
+      { "REQCHATROOM", &chat_session::handle_reqchatroom, false },
+      { "CHANGECHATROOM", &chat_session::handle_changechatroom, false },
+      { "NAMECHATROOM", &chat_session::handle_namechatroom, false },
+      { "NICK", &chat_session::handle_nick, false },
+      { "REQUUID", &chat_session::handle_requuid, false },
+      { "SUBSCRIBE", &chat_session::handle_subscribe, false },
+      { "PROTOCOL", &chat_session::handle_protocol, false },
+      { "CHECKSUM", &chat_session::handle_checksum, false },
+      { "COMPRESS", &chat_session::handle_compress, false },
+      { "MYUUID", &chat_session::handle_myuuid, false },
+      { "REQQUEUES", &chat_session::handle_reqqueues, true },
+      { "STATS", &chat_session::handle_stats, true },
+      { "LOGLEVEL", &chat_session::handle_loglevel, true },
+      { "USERSDELTA", &chat_session::handle_usersdelta, false },
+      { "ROOMSDELTA", &chat_session::handle_roomsdelta, false },
+      { "ADMIN", &chat_session::handle_admin, false },
+    };
+    return table;
+  }
+
+  // The find_command function returns the table entry for the command
+  // [name], or NULL for a command the server does not know.
+  static const command_entry* find_command(boost::string_view name)
+  {
+    for (const command_entry& entry: commands())
+      if (entry.name == name)
+        return &entry;
+    return NULL;
+  }
+
+  // ADMIN,<token> makes this session an admin if the server was started
+  // with that token. The reply is 1 if it is one now, 0 otherwise.
+  void handle_admin(boost::string_view args)
+  {
+    const std::string& token = options_.admin_token;
+    if(!token.empty() && args.size() == token.size()) {
+      // Compare every byte so the time taken does not give the token away.
+      unsigned char diff = 0;
+      for(std::size_t i = 0; i < token.size(); ++i)
+        diff |= args[i] ^ token[i];
+      if(diff == 0)
+        admin_ = true;
+    }
+    reply("ADMIN", admin_ ? "1" : "0");
+  }
+
+  void handle_myuuid(boost::string_view)
+  {
+    CHAT_LOG(log_debug) << get_uuid();
+  }
+
+  void handle_reqchatroom(boost::string_view)
+  {
+    /* Format the reply and send it with the reply method */
+    reply("REQCHATROOM", room_.room_name(get_room()));
+  }
+
+  void handle_requuid(boost::string_view)
+  {
+    std::string s = gen_uuid();
+    set_uuid(s);
+    room_.update_member(shared_from_this());
+    CHAT_LOG(log_debug) << get_uuid() << ": Connected";
+    reply("REQUUID", s);
+  }
+
+  // The client asks for the v2 framing. Every frame we send from now on,
+  // starting with this acknowledgement, uses it.
+  void handle_protocol(boost::string_view args)
+  {
+    if(args == "2") {
+      protocol_ = 2;
+      set_protocol(2);
+    }
+    reply("PROTOCOL", std::to_string(protocol_));
+  }
+
+  // The client asks for another checksum, CRC32C or CRC32. The
+  // acknowledgement still carries the old one, every later frame the new one.
+  void handle_checksum(boost::string_view args)
+  {
+    if(args == "CRC32C" || args == "CRC32") {
+      reply("CHECKSUM", args);
+      set_checksum(args == "CRC32C" ? checksum_crc32c : checksum_crc32);
+    }
+  }
+
+  // The client asks for its backlog in deflate batches. Batches are v2
+  // frames, so this is refused with COMPRESS,NONE on a v1 session.
+  void handle_compress(boost::string_view args)
+  {
+    bool on = args == "DEFLATE" && protocol_ == 2;
+    set_compressed(on);
+    reply("COMPRESS", on ? "DEFLATE" : "NONE");
+  }
+
+  void handle_nick(boost::string_view args)
+  {
+    // a name somebody else has is replaced by a free one like it, the reply
+    // tells the client which name it got
+    std::string m = room_.claim_name(shared_from_this(), std::string(args));
+    if(m != "") {
+      reply("NICK", m);
+    }
+  }
+
+  /**
+  * Need to create a new "message" that will actually be stored with the form:
+  * UUID MESSAGE
+  */
+  void handle_sendtext(boost::string_view args)
+  {
+    // The echo repeats the text, so text too long for the echo to fit the
+    // largest frame is refused with an empty one instead.
+    if(args.size() > max_echo_text) {
+      CHAT_LOG(log_warn) << get_uuid() << " sent " << args.size()
+        << " bytes of text, more than " << std::size_t(max_echo_text);
+      reply("SENDTEXT", "0[];");
+      return;
+    }
+    std::string m(args);
+    room_.deliver(shared_from_this(), make_shared_message(get_uuid() + " " + m + ";"));
+    // A v1 frame cannot repeat all of a long line from a v1 client, so the
+    // echo carries its full length but only as much text as fits. The
+    // message itself is stored whole; v1 readers that cannot take it get a
+    // notice in its place from fitted_page.
+    std::size_t echoed = chat_message::max_body_length_for(protocol_) - echo_overhead;
+    reply("SENDTEXT", std::to_string(m.length()) + "[" + m.substr(0, echoed) + "];");
+  }
+
+  // the checksum, time, command, length and brackets of the echo
+  enum { echo_overhead = 64 };
+  enum { max_echo_text = chat_message::max_v2_body_length - echo_overhead };
+
+  void handle_namechatroom(boost::string_view args)
+  {
+    std::string m(args);
+    if(room_.create_room(m)) {
+      reply("NAMECHATROOM", m);
+    }
+  }
+
+  void handle_changechatroom(boost::string_view args)
+  {
+    std::string m(args);
+    if(room_.join_room(shared_from_this(), m)) {
+      reply("CHANGECHATROOM", m);
+      if(is_subscribed())
+        room_.push_messages(shared_from_this());
+    }
+  }
+
+  void handle_requsers(boost::string_view)
+  {
+    reply("REQUSERS", room_.list_users(shared_from_this()));
+  }
+
+  void handle_reqchatrooms(boost::string_view)
+  {
+    reply("REQCHATROOMS", room_.list_rooms());
+  }
+
+  // USERSDELTA,<token> and ROOMSDELTA,<token> reply with
+  // "<new token>,<entries>" in as many frames as the entries need, or not at
+  // all if nothing changed since the reply <token> came from. An empty
+  // token asks for the whole list. See chat_room::users_since.
+  void handle_usersdelta(boost::string_view args)
+  {
+    std::string token;
+    std::vector<std::string> pages;
+    if(room_.users_since(shared_from_this(), args, presence_budget(), token, pages)) {
+      for(const std::string& page: pages) {
+        reply("USERSDELTA", token + "," + page);
+      }
+    }
+  }
+
+  void handle_roomsdelta(boost::string_view args)
+  {
+    std::string token;
+    std::vector<std::string> pages;
+    if(room_.rooms_since(args, presence_budget(), token, pages)) {
+      for(const std::string& page: pages) {
+        reply("ROOMSDELTA", token + "," + page);
+      }
+    }
+  }
+
+  // A v1 delta or list frame has to hold the checksum, time, command and
+  // token next to the entries within its 512 bytes.
+  enum { presence_overhead = 96 };
+
+  std::size_t presence_budget() const
+  {
+    return protocol_ == 2 ? options_.max_page_bytes
+      : chat_message::max_body_length - presence_overhead;
+  }
+
+  // Sends [list] as one [command] reply per page of whole entries, so a v1
+  // client gets it in frames it can hold.
+  void reply_pages(boost::string_view command, const std::string& list)
+  {
+    for(const std::string& page: chat_room::split_pages(list, presence_budget())) {
+      reply(command, page);
+    }
+  }
+
+  void handle_reqqueues(boost::string_view)
+  {
+    reply_pages("REQQUEUES", room_.list_queues());
+  }
+
+  // STATS replies with the stats report, or with the pairs whose key starts
+  // with the argument, e.g. STATS,cmd.SENDTEXT, in as many frames as it takes.
+  void handle_stats(boost::string_view args)
+  {
+    std::string report = stats_report(room_, metrics_);
+    if(args.empty()) {
+      reply_pages("STATS", report);
+      return;
+    }
+    std::string wanted;
+    for(const std::string& pair: chat_room::split_pages(report, 0)) {
+      if(boost::string_view(pair).starts_with(args))
+        wanted += pair;
+    }
+    reply_pages("STATS", wanted);
+  }
+
+  // LOGLEVEL,<level>[,<every>] changes what the server logs while it runs,
+  // and for lines logged per message how many of them make it, one in
+  // <every>. The reply has the settings now in effect.
+  void handle_loglevel(boost::string_view args)
+  {
+    async_log& log = async_log::get();
+    std::size_t comma = args.find(',');
+    log_level level;
+    if(async_log::parse_level(args.substr(0, comma), level))
+      log.set_level(level);
+    if(comma != boost::string_view::npos)
+      log.set_sample_every(std::strtoul(std::string(args.substr(comma + 1)).c_str(), NULL, 10));
+    std::string settings = async_log::level_name(log.level());
+    boost::algorithm::to_lower(settings);
+    reply("LOGLEVEL", settings + "," + std::to_string(log.sample_every()));
+  }
+
+  // The client wants new messages pushed instead of polling for them.
+  // Acknowledge first so it can stop sending REQTEXT, then catch it up on
+  // anything it has not seen yet.
+  void handle_subscribe(boost::string_view)
+  {
+    set_subscribed(true);
+    reply("SUBSCRIBE", "");
+    room_.push_messages(shared_from_this());
+  }
+
+  // REQTEXT,<token> continues a paged backlog from the token of the page
+  // before, a plain REQTEXT from wherever the session got to.
+  void handle_reqtext(boost::string_view args)
+  {
+    std::size_t resume = std::strtoull(std::string(args).c_str(), NULL, 10);
+    std::string page = room_.update_messages(shared_from_this(), resume);
+    deliver_backlog(shared_from_this(), { make_request_message("REQTEXT", page,
+          get_checksum()) }, options_.max_page_bytes);
   }
 
+  // A client that stops reading must not make the server hold on to every
+  // message sent to its room. Once the frames waiting behind the write in
+  // progress go over the limits, the oldest of them are dropped, and with
+  // queue_mark_missed a MISSED,<count> frame takes their place at the front
+  // of the queue, updated as more go, until it is written. With
+  // queue_disconnect the client is closed instead. The newest frame is never
+  // dropped, so a single large frame still gets through.
+  void limit_queue()
+  {
+    if (write_msgs_.size() <= options_.max_queue_frames
+        && queued_bytes_ <= options_.max_queue_bytes)
+      return;
+    if (options_.queue_full == server_options::queue_disconnect)
+    {
+      CHAT_LOG(log_warn) << get_uuid() << " is not reading, disconnecting";
+      closing_ = true;
+      for (std::size_t i = writing_; i < write_msgs_.size(); ++i)
+        queued_bytes_ -= write_msgs_[i]->body_length();
+      write_msgs_.erase(write_msgs_.begin() + writing_, write_msgs_.end());
+      boost::system::error_code ignored;
+      socket_.shutdown(tcp::socket::shutdown_both, ignored);
+      socket_.close(ignored);
+      return;
+    }
+    std::size_t first = writing_ + (marker_pending_ ? 1 : 0);
+    std::size_t dropped = 0;
+    while ((write_msgs_.size() > options_.max_queue_frames
+          || queued_bytes_ > options_.max_queue_bytes)
+        && write_msgs_.size() - first > 1)
+    {
+      queued_bytes_ -= write_msgs_[first]->body_length();
+      write_msgs_.erase(write_msgs_.begin() + first);
+      ++dropped;
+    }
+    stat_dropped_ += dropped;
+    if (options_.queue_full == server_options::queue_mark_missed && dropped > 0)
+    {
+      missed_ += dropped;
+      chat_message_ptr marker = make_request_message("MISSED",
+          std::to_string(missed_), get_checksum());
+      if (marker_pending_)
+      {
+        queued_bytes_ -= write_msgs_[writing_]->body_length();
+        write_msgs_[writing_] = marker;
+      }
+      else
+      {
+        write_msgs_.insert(write_msgs_.begin() + writing_, marker);
+        marker_pending_ = true;
+      }
+      queued_bytes_ += marker->body_length();
+    }
+  }
+
+  void update_queue_stats()
+  {
+    stat_frames_ = write_msgs_.size();
+    stat_bytes_ = queued_bytes_;
+    if (write_msgs_.size() > stat_peak_)
+      stat_peak_ = write_msgs_.size();
+  }
+
+  // Sends as many queued frames as fit in the configured caps with a single
+  // gather write, always at least one. The frames stay at the front of
+  // [write_msgs_] until the write completes, which keeps their memory alive.
   void do_write()
   {
     auto self(shared_from_this());
-    boost::asio::async_write(socket_,
-        boost::asio::buffer(write_msgs_.front().data(),
-          write_msgs_.front().length()),
-        [this, self](boost::system::error_code ec, std::size_t /*length*/)
+    write_buffers_.clear();
+    std::size_t bytes = 0;
+    writing_ = 0;
+    for (auto& msg: write_msgs_)
+    {
+      std::size_t length = protocol_ == 2
+        ? msg->v2_header_length() + msg->body_length() : msg->length();
+      if (writing_ > 0
+          && (write_buffers_.size() >= options_.max_write_buffers
+            || bytes + length > options_.max_write_bytes))
+        break;
+      // v2 sessions send the shared body behind the frame's v2 header
+      if (protocol_ == 2)
+      {
+        write_buffers_.push_back(boost::asio::buffer(msg->v2_header(), msg->v2_header_length()));
+        write_buffers_.push_back(boost::asio::buffer(msg->body(), msg->body_length()));
+      }
+      else
+      {
+        write_buffers_.push_back(boost::asio::buffer(msg->data(), msg->length()));
+      }
+      bytes += length;
+      ++writing_;
+    }
+    // the MISSED marker is always first in line, so it is in this write
+    marker_pending_ = false;
+    missed_ = 0;
+    boost::asio::async_write(socket_, write_buffers_,
+        strand_.wrap([this, self](boost::system::error_code ec, std::size_t length)
         {
           if (!ec)
           {
-            write_msgs_.erase(write_msgs_.begin());
+            metrics_.frames_out.fetch_add(writing_, std::memory_order_relaxed);
+            metrics_.bytes_out.fetch_add(length, std::memory_order_relaxed);
+            for (std::size_t i = 0; i < writing_; ++i)
+              queued_bytes_ -= write_msgs_[i]->body_length();
+            write_msgs_.erase(write_msgs_.begin(), write_msgs_.begin() + writing_);
+            writing_ = 0;
+            update_queue_stats();
             if (!write_msgs_.empty())
             {
               do_write();
@@ -514,15 +1547,37 @@ private:
           }
           else
           {
-            room_.leave(shared_from_this());
+            leave_room();
           }
-        });
+        }));
   }
 
   tcp::socket socket_;
+  boost::asio::io_service::strand strand_;
   chat_room& room_;
+  const server_options& options_;
+  server_metrics& metrics_;
+  // the framing used for everything sent to this client, 1 or 2
+  int protocol_;
   chat_message read_msg_;
   chat_message_queue write_msgs_;
+  // the buffers of the write in progress and how many frames they cover
+  std::vector<boost::asio::const_buffer> write_buffers_;
+  std::size_t writing_;
+  // bytes of bodies in [write_msgs_]
+  std::size_t queued_bytes_;
+  // whether write_msgs_[writing_] is a MISSED marker for [missed_] frames
+  bool marker_pending_;
+  std::size_t missed_;
+  // set once the client was disconnected for not reading
+  bool closing_;
+  // whether the admin commands are answered for this client
+  bool admin_;
+  // copies of the queue state for get_queue_stats on other threads
+  std::atomic<std::size_t> stat_frames_;
+  std::atomic<std::size_t> stat_bytes_;
+  std::atomic<std::size_t> stat_peak_;
+  std::atomic<std::size_t> stat_dropped_;
 };
 
 //----------------------------------------------------------------------
@@ -531,10 +1586,26 @@ class chat_server
 {
 public:
   chat_server(boost::asio::io_service& io_service,
-      const tcp::endpoint& endpoint)
-    : acceptor_(io_service, endpoint),
-      socket_(io_service)
+      const tcp::endpoint& endpoint, const server_options& options)
+    : io_service_(io_service),
+      options_(options),
+      acceptor_(io_service, endpoint),
+      socket_(io_service),
+      room_("the lobby", options),
+      stats_timer_(io_service)
   {
+    // Each port has its own rooms, so each gets its own log directory.
+    if(options.log_dir != "") {
+      log_.reset(new room_log(options.log_dir + "/"
+            + std::to_string(endpoint.port())));
+      room_.restore(*log_);
+      log_->start();
+    }
+    // Like the logs, each port writes its own stats file.
+    if(options.stats_file != "") {
+      stats_path_ = options.stats_file + "." + std::to_string(endpoint.port());
+      schedule_stats();
+    }
     do_accept();
   }
 
@@ -546,17 +1617,61 @@ private:
         {
           if (!ec)
           {
-            std::make_shared<chat_session>(std::move(socket_), room_)->start();
+            std::make_shared<chat_session>(io_service_, std::move(socket_),
+                room_, options_, metrics_)->start();
           }
 
           do_accept();
         });
   }
 
+  void schedule_stats()
+  {
+    stats_timer_.expires_from_now(std::chrono::seconds(options_.stats_interval));
+    stats_timer_.async_wait(
+        [this](boost::system::error_code ec)
+        {
+          if (!ec)
+          {
+            write_stats();
+            schedule_stats();
+          }
+        });
+  }
+
+  // Writes the stats report to [stats_path_], one "key=value" per line. It
+  // is written next to the file and renamed over it, so a reader never sees
+  // half a report.
+  void write_stats()
+  {
+    std::string report = chat_session::stats_report(room_, metrics_);
+    std::replace(report.begin(), report.end(), ';', '\n');
+    std::string tmp = stats_path_ + ".tmp";
+    {
+      std::ofstream out(tmp.c_str(), std::ios::trunc);
+      out << report;
+      if (!out)
+      {
+        CHAT_LOG(log_error) << "cannot write " << tmp;
+        return;
+      }
+    }
+    if (std::rename(tmp.c_str(), stats_path_.c_str()) != 0)
+      CHAT_LOG(log_error) << "cannot rename " << tmp;
+  }
+
+  boost::asio::io_service& io_service_;
+  server_options options_;
+  // declared before [room_] so it outlives the room that writes to it
+  std::unique_ptr<room_log> log_;
   tcp::acceptor acceptor_;
   tcp::socket socket_;
   //creates the default room with the name "the lobby"
-  chat_room room_ {"the lobby"};
+  chat_room room_;
+  // shared by every session of this port
+  server_metrics metrics_;
+  boost::asio::steady_timer stats_timer_;
+  std::string stats_path_;
 };
 
 //----------------------------------------------------------------------
@@ -565,22 +1680,104 @@ int main(int argc, char* argv[])
 {
   try
   {
-    if (argc < 2)
+    // Options come in pairs before the list of ports:
+    //   -t <threads>   threads running the io_service, one per core by default
+    //   -m <messages>  the most messages kept in each room's history
+    //   -b <bytes>     the most bytes kept in each room's history, 0 for no limit
+    //   -d <dir>       directory to keep the rooms and messages in across restarts
+    //   -w <bytes>     the most bytes a session sends in one write
+    //   -i <frames>    the most frames a session sends in one write
+    //   -p <bytes>     the most bytes of history in one REQTEXT to a v2 client
+    //   -q <frames>    the most frames waiting to be sent to one client
+    //   -u <bytes>     the most bytes waiting to be sent to one client
+    //   -o <policy>    what to do when a client is over those limits: drop
+    //                  (oldest frames), mark (drop and send MISSED,<count>)
+    //                  or close (disconnect it)
+    //   -s <file>      write the stats report to <file>.<port> periodically
+    //   -r <seconds>   how often the stats file is written, every 10s by default
+    //   -l <level>     what to log: error, warn, info (the default), debug or
+    //                  trace, which adds every line received
+    //   -n <every>     log only one in <every> received lines at trace level
+    //   -k <token>     answer STATS, REQQUEUES and LOGLEVEL for clients that
+    //                  sent ADMIN,<token>, only for local clients without one
+    server_options options;
+    log_level level;
+    int first_port = 1;
+    while (first_port + 1 < argc && argv[first_port][0] == '-')
+    {
+      std::string flag = argv[first_port];
+      const char* value = argv[first_port + 1];
+      if (flag == "-t")
+        options.threads = std::atoi(value);
+      else if (flag == "-m")
+        options.max_recent_msgs = std::strtoull(value, NULL, 10);
+      else if (flag == "-b")
+        options.max_recent_bytes = std::strtoull(value, NULL, 10);
+      else if (flag == "-d")
+        options.log_dir = value;
+      else if (flag == "-w")
+        options.max_write_bytes = std::strtoull(value, NULL, 10);
+      else if (flag == "-i")
+        options.max_write_buffers = std::strtoull(value, NULL, 10);
+      else if (flag == "-p")
+        options.max_page_bytes = std::strtoull(value, NULL, 10);
+      else if (flag == "-q")
+        options.max_queue_frames = std::strtoull(value, NULL, 10);
+      else if (flag == "-u")
+        options.max_queue_bytes = std::strtoull(value, NULL, 10);
+      else if (flag == "-o" && std::string(value) == "drop")
+        options.queue_full = server_options::queue_drop_oldest;
+      else if (flag == "-o" && std::string(value) == "mark")
+        options.queue_full = server_options::queue_mark_missed;
+      else if (flag == "-o" && std::string(value) == "close")
+        options.queue_full = server_options::queue_disconnect;
+      else if (flag == "-s")
+        options.stats_file = value;
+      else if (flag == "-r" && std::atoi(value) > 0)
+        options.stats_interval = std::atoi(value);
+      else if (flag == "-l" && async_log::parse_level(value, level))
+        async_log::get().set_level(level);
+      else if (flag == "-n")
+        async_log::get().set_sample_every(std::strtoul(value, NULL, 10));
+      else if (flag == "-k")
+        options.admin_token = value;
+      else
+        break;
+      first_port += 2;
+    }
+    unsigned int thread_count = options.threads;
+    if (thread_count < 1)
+      thread_count = std::thread::hardware_concurrency();
+    if (thread_count < 1)
+      thread_count = 1;
+
+    if (argc <= first_port || argv[first_port][0] == '-')
     {
-      std::cerr << "Usage: chat_server <port> [<port> ...]\n";
+      std::cerr << "Usage: chat_server [-t <threads>] [-m <messages>] [-b <bytes>]"
+        " [-d <dir>] [-w <bytes>] [-i <frames>] [-p <bytes>]"
+        " [-q <frames>] [-u <bytes>] [-o drop|mark|close] [-s <file>]"
+        " [-r <seconds>] [-l <level>] [-n <every>] [-k <token>]"
+        " <port> [<port> ...]\n";
       return 1;
     }
 
     boost::asio::io_service io_service;
 
     std::list<chat_server> servers;
-    for (int i = 1; i < argc; ++i)
+    for (int i = first_port; i < argc; ++i)
     {
       tcp::endpoint endpoint(tcp::v4(), std::atoi(argv[i]));
-      servers.emplace_back(io_service, endpoint);
+      servers.emplace_back(io_service, endpoint, options);
     }
 
+    // Every thread in the pool runs the same io_service, sessions keep their
+    // own handlers in order through their strands.
+    std::vector<std::thread> pool;
+    for (unsigned int i = 1; i < thread_count; ++i)
+      pool.emplace_back([&io_service](){ io_service.run(); });
     io_service.run();
+    for (auto& t: pool)
+      t.join();
   }
   catch (std::exception& e)
   {
@@ -0,0 +1,128 @@
+//
+// crc32c.hpp
+// ~~~~~~~~~~
+//
+// CRC-32C (Castagnoli) for the optional per-connection checksum mode.
+//
+
+#ifndef CRC32C_HPP
+#define CRC32C_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+/*
+  The crc32c_tables struct holds the eight lookup tables of the
+  slicing-by-8 software implementation, built once on first use.
+*/
+struct crc32c_tables
+{
+  std::uint32_t t[8][256];
+
+  crc32c_tables()
+  {
+    for (std::uint32_t i = 0; i < 256; ++i)
+    {
+      std::uint32_t crc = i;
+      for (int k = 0; k < 8; ++k)
+        crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+      t[0][i] = crc;
+    }
+    for (std::uint32_t i = 0; i < 256; ++i)
+      for (int k = 1; k < 8; ++k)
+        t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+  }
+
+  static const crc32c_tables& get()
+  {
+    static const crc32c_tables tables;
+    return tables;
+  }
+};
+
+/*
+  Software CRC-32C, eight bytes per step. [crc] is the value returned by a
+  previous call (0 to start), like zlib's crc32.
+*/
+inline std::uint32_t crc32c_sw(std::uint32_t crc, const void* data,
+    std::size_t length)
+{
+  const crc32c_tables& tab = crc32c_tables::get();
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  crc = ~crc;
+  while (length >= 8)
+  {
+    std::uint32_t lo, hi;
+    std::memcpy(&lo, p, 4);
+    std::memcpy(&hi, p + 4, 4);
+    lo ^= crc;
+    crc = tab.t[7][lo & 0xff] ^ tab.t[6][(lo >> 8) & 0xff]
+      ^ tab.t[5][(lo >> 16) & 0xff] ^ tab.t[4][lo >> 24]
+      ^ tab.t[3][hi & 0xff] ^ tab.t[2][(hi >> 8) & 0xff]
+      ^ tab.t[1][(hi >> 16) & 0xff] ^ tab.t[0][hi >> 24];
+    p += 8;
+    length -= 8;
+  }
+  while (length--)
+    crc = (crc >> 8) ^ tab.t[0][(crc ^ *p++) & 0xff];
+  return ~crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+// CRC-32C with the SSE4.2 crc32 instruction, only called after
+// crc32c_hw_available() said the CPU has it.
+__attribute__((target("sse4.2")))
+inline std::uint32_t crc32c_hw(std::uint32_t crc, const void* data,
+    std::size_t length)
+{
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  crc = ~crc;
+#ifdef __x86_64__
+  std::uint64_t crc64 = crc;
+  while (length >= 8)
+  {
+    std::uint64_t word;
+    std::memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    p += 8;
+    length -= 8;
+  }
+  crc = static_cast<std::uint32_t>(crc64);
+#endif
+  while (length--)
+    crc = _mm_crc32_u8(crc, *p++);
+  return ~crc;
+}
+#endif
+
+inline bool crc32c_hw_available()
+{
+#ifdef CRC32C_HAVE_SSE42
+  static const bool available = __builtin_cpu_supports("sse4.2");
+  return available;
+#else
+  return false;
+#endif
+}
+
+/*
+  CRC-32C of [length] bytes at [data], continuing from [crc]. Uses the
+  SSE4.2 instruction when the CPU has it and slicing-by-8 otherwise.
+*/
+inline std::uint32_t crc32c(std::uint32_t crc, const void* data,
+    std::size_t length)
+{
+#ifdef CRC32C_HAVE_SSE42
+  if (crc32c_hw_available())
+    return crc32c_hw(crc, data, length);
+#endif
+  return crc32c_sw(crc, data, length);
+}
+
+#endif // CRC32C_HPP
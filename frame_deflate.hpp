@@ -0,0 +1,133 @@
+//
+// frame_deflate.hpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Deflate-compressed batches of frames for replaying room history.
+//
+
+#ifndef FRAME_DEFLATE_HPP
+#define FRAME_DEFLATE_HPP
+
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "chat_message.hpp"
+
+/*
+  A v2 frame of type chat_message::v2_deflate carries a zlib stream that
+  inflates to a sequence of complete v2 frames. The server packs backlog
+  replay into such batches for clients that asked for it, so a join into a
+  busy room is one small frame instead of many plain ones; the receiver
+  inflates the batch and handles the frames in it as if they had arrived
+  one by one.
+*/
+
+// Packs [frames] into one deflate batch. Returns an empty pointer if the
+// batch would not fit in a v2 frame, callers then send the frames as they are.
+inline chat_message_ptr deflate_frames(const std::vector<chat_message_ptr>& frames,
+    int level = Z_BEST_SPEED)
+{
+  std::size_t total = 0;
+  for (const chat_message_ptr& frame: frames)
+    total += frame->v2_header_length() + frame->body_length();
+
+  z_stream zs;
+  std::memset(&zs, 0, sizeof(zs));
+  if (deflateInit(&zs, level) != Z_OK)
+    throw std::runtime_error("deflate_frames: deflateInit failed");
+  std::size_t bound = deflateBound(&zs, total);
+  if (bound > chat_message::max_body_length_for(2))
+  {
+    deflateEnd(&zs);
+    return chat_message_ptr();
+  }
+
+  std::shared_ptr<chat_message> batch = std::make_shared<chat_message>();
+  batch->body_length(bound);
+  zs.next_out = reinterpret_cast<Bytef*>(batch->body());
+  zs.avail_out = bound;
+  for (const chat_message_ptr& frame: frames)
+  {
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(frame->v2_header()));
+    zs.avail_in = frame->v2_header_length();
+    deflate(&zs, Z_NO_FLUSH);
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(frame->body()));
+    zs.avail_in = frame->body_length();
+    deflate(&zs, Z_NO_FLUSH);
+  }
+  // deflateBound leaves room for everything, so this finishes in one call
+  int result = deflate(&zs, Z_FINISH);
+  std::size_t length = zs.total_out;
+  deflateEnd(&zs);
+  if (result != Z_STREAM_END)
+    throw std::runtime_error("deflate_frames: deflate did not finish");
+
+  batch->body_length(length);
+  batch->encode_header(chat_message::v2_deflate);
+  return batch;
+}
+
+// Inflates the deflate batch [batch] and calls on_frame(const chat_message&)
+// for every frame in it, in order. Returns false if the batch is corrupt, ends
+// inside a frame or inflates to more than [max_bytes]; the frames before the
+// problem have been handled by then.
+template <typename FrameHandler>
+bool inflate_frames(const chat_message& batch, FrameHandler on_frame,
+    std::size_t max_bytes = chat_message::max_v2_body_length)
+{
+  z_stream zs;
+  std::memset(&zs, 0, sizeof(zs));
+  if (inflateInit(&zs) != Z_OK)
+    return false;
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(batch.body()));
+  zs.avail_in = batch.body_length();
+
+  std::string plain;
+  int result = Z_OK;
+  while (result == Z_OK)
+  {
+    std::size_t have = plain.size();
+    std::size_t grow = have < 4096 ? 4096 : have;
+    if (have + grow > max_bytes)
+      grow = max_bytes - have;
+    if (grow == 0)
+      break;
+    plain.resize(have + grow);
+    zs.next_out = reinterpret_cast<Bytef*>(&plain[have]);
+    zs.avail_out = grow;
+    result = inflate(&zs, Z_NO_FLUSH);
+    plain.resize(have + grow - zs.avail_out);
+  }
+  inflateEnd(&zs);
+  if (result != Z_STREAM_END)
+    return false;
+
+  std::size_t pos = 0;
+  while (pos < plain.size())
+  {
+    chat_message frame;
+    std::size_t have = 0;
+    std::size_t want = chat_message::header_length;
+    while (want > 0)
+    {
+      if (plain.size() - pos < want)
+        return false;
+      std::memcpy(frame.header_buffer() + have, plain.data() + pos, want);
+      pos += want;
+      have += want;
+      want = frame.missing_header_bytes(have);
+    }
+    if (!frame.decode_header(have) || plain.size() - pos < frame.body_length())
+      return false;
+    std::memcpy(frame.body(), plain.data() + pos, frame.body_length());
+    pos += frame.body_length();
+    on_frame(static_cast<const chat_message&>(frame));
+  }
+  return true;
+}
+
+#endif // FRAME_DEFLATE_HPP
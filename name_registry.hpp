@@ -0,0 +1,122 @@
+//
+// name_registry.hpp
+// ~~~~~~~~~~~~~~~~~
+//
+// The set of nicknames in use on a chat server.
+//
+
+#ifndef NAME_REGISTRY_HPP
+#define NAME_REGISTRY_HPP
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+/*
+  The name_registry class maps every nickname in use to the id of the
+  session holding it, so checking, claiming and releasing a name are hash
+  lookups whatever the number of users. It does no locking; the chat_room
+  calls it under its own mutex together with setting the participant's
+  name, so the two never disagree.
+
+  When a name is taken suggest() offers "name2", "name3", ... It remembers
+  the last number it handed out for every name, so a popular name does not
+  make it walk all the earlier ones again. It also counts the names held
+  that start with that name and end in a number, and forgets the name once
+  the last of them is released, so the counters do not pile up.
+*/
+class name_registry
+{
+public:
+  typedef std::uint32_t owner_id;
+
+  bool taken(const std::string& name) const
+  {
+    return names_.count(name) != 0;
+  }
+
+  // Gives [name] to [owner] unless somebody else has it. Claiming a name
+  // the owner already has succeeds.
+  bool claim(const std::string& name, owner_id owner)
+  {
+    auto inserted = names_.emplace(name, owner);
+    if (inserted.second)
+      count_holder(name, true);
+    return inserted.second || inserted.first->second == owner;
+  }
+
+  // Frees [name] if [owner] holds it.
+  void release(const std::string& name, owner_id owner)
+  {
+    auto found = names_.find(name);
+    if (found != names_.end() && found->second == owner)
+    {
+      names_.erase(found);
+      count_holder(name, false);
+    }
+  }
+
+  // A name based on [name] that nobody has yet
+  std::string suggest(const std::string& name)
+  {
+    if (!taken(name))
+      return name;
+    // [name] itself is the first holder
+    unsigned long& last = suffixes_.emplace(name, suffix_state{ 1, 1 })
+      .first->second.last;
+    std::string candidate;
+    do
+    {
+      candidate = name + std::to_string(++last);
+    } while (taken(candidate));
+    return candidate;
+  }
+
+  std::size_t size() const
+  {
+    return names_.size();
+  }
+
+  // How many names suggest() keeps a counter for
+  std::size_t suffixes() const
+  {
+    return suffixes_.size();
+  }
+
+private:
+  struct suffix_state
+  {
+    // the last number handed out and the names held that it counts
+    unsigned long last;
+    std::size_t holders;
+  };
+
+  // Counts [name] in or out of the counter for itself and the one for the
+  // name without its trailing digits, where they exist. A counter whose
+  // last holder goes is dropped.
+  void count_holder(const std::string& name, bool held)
+  {
+    std::size_t digits = name.find_last_not_of("0123456789") + 1;
+    count_holder_of(name, held);
+    if (digits > 0 && digits < name.size())
+      count_holder_of(name.substr(0, digits), held);
+  }
+
+  void count_holder_of(const std::string& base, bool held)
+  {
+    auto found = suffixes_.find(base);
+    if (found == suffixes_.end())
+      return;
+    if (held)
+      ++found->second.holders;
+    else if (found->second.holders <= 1)
+      suffixes_.erase(found);
+    else
+      --found->second.holders;
+  }
+
+  std::unordered_map<std::string, owner_id> names_;
+  std::unordered_map<std::string, suffix_state> suffixes_;
+};
+
+#endif // NAME_REGISTRY_HPP
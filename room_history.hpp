@@ -0,0 +1,171 @@
+//
+// room_history.hpp
+// ~~~~~~~~~~~~~~~~
+//
+// A bounded log of the messages sent to one chat room.
+//
+
+#ifndef ROOM_HISTORY_HPP
+#define ROOM_HISTORY_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "chat_message.hpp"
+
+/*
+  The room_history class keeps the most recent messages of a chat room in a
+  ring buffer. It holds at most [max_msgs] messages and at most [max_bytes]
+  bytes of message bodies (0 means no byte limit); when either limit is hit
+  the oldest messages are evicted in O(1) each. Messages are kept as shared
+  frames so replaying history to a participant does not copy them.
+
+  Every message gets a sequence number that keeps counting up even after it
+  is evicted, so participants can hold a cursor into the history. A cursor
+  older than first_seq() simply points at messages that are gone and readers
+  continue from first_seq().
+*/
+class room_history
+{
+public:
+  // The most message bytes one REQTEXT page to a v1 client can carry: its
+  // 512 byte body also holds the checksum, time, command and resume token.
+  enum { v1_page_bytes = chat_message::max_body_length - 64 };
+
+  room_history(std::size_t max_msgs, std::size_t max_bytes)
+    : max_msgs_(max_msgs < 1 ? 1 : max_msgs),
+      max_bytes_(max_bytes),
+      head_(0),
+      count_(0),
+      bytes_(0),
+      first_seq_(0)
+  {
+  }
+
+  // Appends [msg], evicting from the front until both limits hold again. The
+  // newest message is always kept even if it alone is over the byte limit.
+  void push_back(const chat_message_ptr& msg)
+  {
+    if (count_ == slots_.size())
+    {
+      if (slots_.size() < max_msgs_)
+        grow();
+      else
+        pop_front();
+    }
+    slots_[(head_ + count_) % slots_.size()] = msg;
+    ++count_;
+    bytes_ += msg->body_length();
+    while (max_bytes_ != 0 && bytes_ > max_bytes_ && count_ > 1)
+      pop_front();
+  }
+
+  // Sequence number of the oldest message still stored
+  std::size_t first_seq() const
+  {
+    return first_seq_;
+  }
+
+  // Sequence number the next message will get
+  std::size_t end_seq() const
+  {
+    return first_seq_ + count_;
+  }
+
+  // The message with sequence number [seq], which must be in
+  // [first_seq(), end_seq())
+  const chat_message_ptr& at(std::size_t seq) const
+  {
+    return slots_[(head_ + (seq - first_seq_)) % slots_.size()];
+  }
+
+  // Moves a cursor that fell behind the evicted messages up to first_seq()
+  std::size_t clamp(std::size_t seq) const
+  {
+    return seq < first_seq_ ? first_seq_ : seq;
+  }
+
+  // Appends the bodies of the messages from [seq] on to [out], as many whole
+  // messages as fit in [budget] bytes but always at least one, and returns
+  // the sequence number of the first message left out (end_seq() when all
+  // of them fit). [seq] is clamped first.
+  std::size_t page(std::size_t seq, std::size_t budget, std::string& out) const
+  {
+    std::size_t used = 0;
+    for (seq = clamp(seq); seq < end_seq(); ++seq)
+    {
+      std::size_t length = at(seq)->body_length();
+      if (used > 0 && used + length > budget)
+        break;
+      out.append(at(seq)->body(), length);
+      used += length;
+    }
+    return seq;
+  }
+
+  // Like page, but never goes over [budget]: when the message at [seq] is
+  // too big on its own it is replaced by a notice with its sender and size,
+  // "<uuid> [<n> byte message not shown];", so the reader still moves past
+  // it knowing what it missed.
+  std::size_t fitted_page(std::size_t seq, std::size_t budget, std::string& out) const
+  {
+    seq = clamp(seq);
+    if (seq == end_seq() || at(seq)->body_length() <= budget)
+      return page(seq, budget, out);
+    const chat_message& msg = *at(seq);
+    const char* space = static_cast<const char*>(
+        std::memchr(msg.body(), ' ', msg.body_length()));
+    if (space)
+      out.append(msg.body(), space - msg.body() + 1);
+    out += "[" + std::to_string(msg.body_length()) + " byte message not shown];";
+    return seq + 1;
+  }
+
+  std::size_t size() const
+  {
+    return count_;
+  }
+
+  std::size_t bytes() const
+  {
+    return bytes_;
+  }
+
+private:
+  void pop_front()
+  {
+    bytes_ -= slots_[head_]->body_length();
+    slots_[head_].reset();
+    head_ = (head_ + 1) % slots_.size();
+    --count_;
+    ++first_seq_;
+  }
+
+  // Rooms start small and double up to [max_msgs_] slots, so quiet rooms do
+  // not reserve the whole capacity up front.
+  void grow()
+  {
+    std::size_t new_size = slots_.size() * 2;
+    if (new_size < 16)
+      new_size = 16;
+    if (new_size > max_msgs_)
+      new_size = max_msgs_;
+    std::vector<chat_message_ptr> bigger(new_size);
+    for (std::size_t i = 0; i < count_; ++i)
+      bigger[i] = slots_[(head_ + i) % slots_.size()];
+    slots_.swap(bigger);
+    head_ = 0;
+  }
+
+  std::size_t max_msgs_;
+  std::size_t max_bytes_;
+  std::vector<chat_message_ptr> slots_;
+  std::size_t head_;
+  std::size_t count_;
+  std::size_t bytes_;
+  std::size_t first_seq_;
+};
+
+#endif // ROOM_HISTORY_HPP
@@ -0,0 +1,500 @@
+//
+// room_log.hpp
+// ~~~~~~~~~~~~
+//
+// Append-only on-disk log of the rooms and messages of a chat server.
+//
+
+#ifndef ROOM_LOG_HPP
+#define ROOM_LOG_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "async_log.hpp"
+
+/*
+  The room_log class stores every room creation and every message sent to a
+  room so a restarted server gets its rooms and history back.
+
+  The log is a directory of segment files named segment-NNNNNNNN.log. Each
+  segment is a sequence of records:
+
+    uint32 payload length | uint32 crc32 of type and payload | type | payload
+
+  where type is 'R' for a new room (payload: the room name) or 'M' for a
+  message (payload: uint16 room name length, room name, message body).
+  Once a segment would grow past [segment_bytes] the next record goes into
+  a new one, which starts with an 'R' record for every room so far. A
+  segment is then only needed for its messages, and drop_before() deletes
+  the ones whose messages the server no longer keeps in memory.
+
+  Appends only copy the record into a pending buffer. A background thread
+  writes everything pending in one write() and one fdatasync(), so all the
+  appends that arrive while a sync is running share the next one (group
+  commit). A crash can lose the batch that was not synced yet, never
+  corrupt what was.
+
+  If a write or a sync fails the segment is cut back to the end of the last
+  batch that made it to disk and the log stops recording: everything
+  stored up to then stays readable, and failures() tells the server.
+
+  On startup replay() maps each segment into memory and walks its records.
+  A torn or corrupt record at the end of the newest segment is cut off so
+  new appends follow the last good record.
+*/
+class room_log
+{
+public:
+  enum { record_header_length = 9 };
+  enum { default_segment_bytes = 64 * 1024 * 1024 };
+  // the longest room name the uint16 length of a message record can hold
+  enum { max_room_name = 0xffff };
+
+  explicit room_log(const std::string& dir,
+      std::size_t segment_bytes = default_segment_bytes)
+    : dir_(dir),
+      segment_bytes_(segment_bytes),
+      fd_(-1),
+      replaying_(0),
+      good_size_(0),
+      failures_(0),
+      append_segment_(0),
+      segment_size_(0),
+      preamble_size_(0),
+      write_segment_(0),
+      failed_(false),
+      stopping_(false)
+  {
+    make_dirs(dir_);
+    DIR* d = ::opendir(dir_.c_str());
+    if (!d)
+      throw std::runtime_error("room_log: cannot open " + dir_);
+    while (struct dirent* entry = ::readdir(d))
+    {
+      unsigned int number;
+      char tail;
+      if (std::sscanf(entry->d_name, "segment-%8u.lo%c", &number, &tail) == 2
+          && tail == 'g')
+        segments_.push_back(number);
+    }
+    ::closedir(d);
+    std::sort(segments_.begin(), segments_.end());
+  }
+
+  ~room_log()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cond_.notify_one();
+    if (writer_.joinable())
+      writer_.join();
+    if (fd_ >= 0)
+      ::close(fd_);
+  }
+
+  // Walks every stored record in order, calling on_room(name) for each room
+  // and on_message(room, body, length) for each message. Must be called
+  // before start(). Returns the number of records read.
+  template <typename RoomHandler, typename MessageHandler>
+  std::size_t replay(RoomHandler on_room, MessageHandler on_message)
+  {
+    std::size_t records = 0;
+    for (std::size_t i = 0; i < segments_.size(); ++i)
+    {
+      replaying_ = segments_[i];
+      std::string path = segment_path(segments_[i]);
+      int fd = ::open(path.c_str(), O_RDWR);
+      if (fd < 0)
+        throw std::runtime_error("room_log: cannot open " + path);
+      struct stat st;
+      ::fstat(fd, &st);
+      std::size_t size = st.st_size;
+      std::size_t good = 0;
+      if (size > 0)
+      {
+        void* map = ::mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+          ::close(fd);
+          throw std::runtime_error("room_log: cannot map " + path);
+        }
+        ::madvise(map, size, MADV_SEQUENTIAL);
+        const char* base = static_cast<const char*>(map);
+        while (good + record_header_length <= size)
+        {
+          std::uint32_t length, crc;
+          std::memcpy(&length, base + good, 4);
+          std::memcpy(&crc, base + good + 4, 4);
+          if (length > size - good - record_header_length)
+            break;
+          const char* type = base + good + 8;
+          if (checksum(type, length + 1) != crc || !dispatch(*type, type + 1,
+                length, on_room, on_message, room_names_))
+            break;
+          good += record_header_length + length;
+          ++records;
+        }
+        ::munmap(map, size);
+      }
+      if (good < size)
+      {
+        CHAT_LOG(log_warn) << "room_log: " << path << ": dropping "
+          << size - good << " bytes after the last good record";
+        if (i + 1 == segments_.size() && ::ftruncate(fd, good) != 0)
+          CHAT_LOG(log_warn) << "room_log: cannot truncate " << path;
+      }
+      ::close(fd);
+    }
+    return records;
+  }
+
+  // The segment the record being replayed came from, for on_message
+  // handlers that keep track of which segments they still need.
+  unsigned int replaying() const
+  {
+    return replaying_;
+  }
+
+  // Opens the newest segment for appending and starts the writer thread.
+  void start()
+  {
+    if (segments_.empty())
+      segments_.push_back(1);
+    if (!open_segment(segments_.back()))
+      throw std::runtime_error("room_log: cannot open "
+          + segment_path(segments_.back()));
+    struct stat st;
+    ::fstat(fd_, &st);
+    segment_size_ = st.st_size;
+    good_size_ = st.st_size;
+    write_segment_ = segments_.back();
+    append_segment_ = segments_.back();
+    writer_ = std::thread([this](){ write_loop(); });
+  }
+
+  void append_room(const std::string& room)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (failed_)
+      return;
+    // recorded before it joins [room_names_], so a new segment started for
+    // it does not list it twice
+    if (room_names_.count(room) == 0)
+    {
+      put_room(room);
+      room_names_.insert(room);
+    }
+    cond_.notify_one();
+  }
+
+  // Queues a message to [room] and returns the segment it goes into, or 0
+  // when the room name is too long to record or the log has failed.
+  unsigned int append_message(const std::string& room, const char* body,
+      std::size_t length)
+  {
+    if (room.size() > max_room_name)
+    {
+      CHAT_LOG(log_warn) << "room_log: not recording a message to a room"
+        " with a " << room.size() << " byte name";
+      return 0;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (failed_)
+      return 0;
+    std::uint16_t room_length = room.size();
+    put_header('M', 2 + room.size() + length);
+    pending_.append(reinterpret_cast<const char*>(&room_length), 2);
+    pending_.append(room);
+    pending_.append(body, length);
+    cond_.notify_one();
+    return append_segment_;
+  }
+
+  // Deletes every segment before [segment]. The segment being appended to
+  // and the one being written are always kept.
+  void drop_before(unsigned int segment)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    segment = std::min(segment, std::min(append_segment_, write_segment_));
+    std::size_t dropped = 0;
+    while (dropped < segments_.size() && segments_[dropped] < segment)
+    {
+      std::string path = segment_path(segments_[dropped]);
+      if (::unlink(path.c_str()) != 0 && errno != ENOENT)
+        CHAT_LOG(log_warn) << "room_log: cannot remove " << path;
+      ++dropped;
+    }
+    segments_.erase(segments_.begin(), segments_.begin() + dropped);
+  }
+
+  // How many times writing the log failed; after the first nothing more is
+  // recorded.
+  std::uint64_t failures() const
+  {
+    return failures_.load(std::memory_order_relaxed);
+  }
+
+private:
+  template <typename RoomHandler, typename MessageHandler>
+  static bool dispatch(char type, const char* payload, std::size_t length,
+      RoomHandler& on_room, MessageHandler& on_message,
+      std::set<std::string>& room_names)
+  {
+    if (type == 'R')
+    {
+      std::string room(payload, length);
+      room_names.insert(room);
+      on_room(room);
+      return true;
+    }
+    if (type == 'M' && length >= 2)
+    {
+      std::uint16_t room_length;
+      std::memcpy(&room_length, payload, 2);
+      if (room_length > length - 2)
+        return false;
+      on_message(std::string(payload + 2, room_length),
+          payload + 2 + room_length, length - 2 - room_length);
+      return true;
+    }
+    return false;
+  }
+
+  static std::uint32_t checksum(const char* data, std::size_t length)
+  {
+    return crc32(crc32(0L, Z_NULL, 0),
+        reinterpret_cast<const unsigned char*>(data), length);
+  }
+
+  void put_room(const std::string& room)
+  {
+    put_header('R', room.size());
+    pending_.append(room);
+  }
+
+  // Appends a record header to [pending_], first starting a new segment if
+  // the record would not fit in the current one. A segment that holds
+  // nothing but its room records takes the record anyway, even when the
+  // rooms alone fill it.
+  void put_header(char type, std::size_t length)
+  {
+    std::size_t record = record_header_length + length;
+    if (segment_size_ > preamble_size_ && segment_size_ + record > segment_bytes_)
+      roll_segment();
+    put_record_header(type, length);
+  }
+
+  // Starts the next segment with an 'R' record for every room so far. The
+  // records go straight in, they never start yet another segment.
+  void roll_segment()
+  {
+    ++append_segment_;
+    segments_.push_back(append_segment_);
+    rolls_.push_back(pending_.size());
+    segment_size_ = 0;
+    for (const std::string& room : room_names_)
+    {
+      put_record_header('R', room.size());
+      pending_.append(room);
+    }
+    preamble_size_ = segment_size_;
+  }
+
+  // The crc covers the type byte and the payload, so it is patched in by
+  // write_loop once the payload is there.
+  void put_record_header(char type, std::size_t length)
+  {
+    segment_size_ += record_header_length + length;
+    std::uint32_t len = length;
+    std::uint32_t crc = 0;
+    pending_.append(reinterpret_cast<const char*>(&len), 4);
+    pending_.append(reinterpret_cast<const char*>(&crc), 4);
+    pending_.push_back(type);
+  }
+
+  void write_loop()
+  {
+    std::string batch;
+    std::vector<std::size_t> rolls;
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;)
+    {
+      cond_.wait(lock, [this](){ return stopping_ || !pending_.empty(); });
+      if (pending_.empty())
+        break;
+      batch.swap(pending_);
+      rolls.swap(rolls_);
+      unsigned int segment = write_segment_;
+      lock.unlock();
+
+      seal(batch);
+      // each offset in [rolls] is where the records of the next segment start
+      std::size_t off = 0;
+      bool ok = true;
+      for (std::size_t roll : rolls)
+      {
+        ok = write_synced(batch.data() + off, roll - off)
+          && open_segment(++segment);
+        if (!ok)
+          break;
+        good_size_ = 0;
+        off = roll;
+      }
+      ok = ok && write_synced(batch.data() + off, batch.size() - off);
+      batch.clear();
+      rolls.clear();
+
+      lock.lock();
+      write_segment_ = segment;
+      if (!ok)
+        fail();
+    }
+  }
+
+  // Writes [left] bytes at [p] to the open segment and syncs them. On
+  // success the segment is good up to its new end.
+  bool write_synced(const char* p, std::size_t left)
+  {
+    if (!write_all(p, left))
+      return false;
+    if (::fdatasync(fd_) != 0)
+    {
+      CHAT_LOG(log_error) << "room_log: sync failed: " << std::strerror(errno);
+      return false;
+    }
+    good_size_ += left;
+    return true;
+  }
+
+  // Called with [mutex_] held after a failed write, sync or open. Cuts a
+  // partly written batch off the open segment so it ends with a whole
+  // record, and stops recording: the appends that were waiting are dropped
+  // and later ones refused.
+  void fail()
+  {
+    failures_.fetch_add(1, std::memory_order_relaxed);
+    if (fd_ >= 0 && ::ftruncate(fd_, good_size_) != 0)
+      CHAT_LOG(log_error) << "room_log: cannot cut segment "
+        << write_segment_ << " back to " << good_size_ << " bytes";
+    CHAT_LOG(log_error) << "room_log: not recording anything more";
+    failed_ = true;
+    pending_.clear();
+    rolls_.clear();
+  }
+
+  // Fills in the crc of every record in [batch].
+  static void seal(std::string& batch)
+  {
+    std::size_t off = 0;
+    while (off + record_header_length <= batch.size())
+    {
+      std::uint32_t length;
+      std::memcpy(&length, &batch[off], 4);
+      std::uint32_t crc = checksum(&batch[off + 8], length + 1);
+      std::memcpy(&batch[off + 4], &crc, 4);
+      off += record_header_length + length;
+    }
+  }
+
+  bool write_all(const char* p, std::size_t left)
+  {
+    while (left > 0)
+    {
+      ssize_t n = ::write(fd_, p, left);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+      {
+        CHAT_LOG(log_error) << "room_log: write failed: "
+          << std::strerror(errno);
+        return false;
+      }
+      p += n;
+      left -= n;
+    }
+    return true;
+  }
+
+  bool open_segment(unsigned int number)
+  {
+    if (fd_ >= 0)
+      ::close(fd_);
+    std::string path = segment_path(number);
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0)
+      CHAT_LOG(log_error) << "room_log: cannot open " << path << ": "
+        << std::strerror(errno);
+    return fd_ >= 0;
+  }
+
+  std::string segment_path(unsigned int number) const
+  {
+    char name[32];
+    std::snprintf(name, sizeof(name), "segment-%08u.log", number);
+    return dir_ + "/" + name;
+  }
+
+  static void make_dirs(const std::string& dir)
+  {
+    for (std::size_t pos = 1; pos <= dir.size(); ++pos)
+    {
+      if (pos == dir.size() || dir[pos] == '/')
+      {
+        std::string prefix = dir.substr(0, pos);
+        if (::mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+          throw std::runtime_error("room_log: cannot create " + prefix);
+      }
+    }
+  }
+
+  std::string dir_;
+  std::size_t segment_bytes_;
+  int fd_;
+  unsigned int replaying_;
+  // how much of the segment the writer has open is synced, writer only
+  std::size_t good_size_;
+  std::atomic<std::uint64_t> failures_;
+
+  // everything below is shared with the writer thread
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  // the segments on disk, oldest first
+  std::vector<unsigned int> segments_;
+  // every room recorded, for the start of each new segment
+  std::set<std::string> room_names_;
+  // the segment new records go into, how big it is with them and how much
+  // of that is the room records it started with
+  unsigned int append_segment_;
+  std::size_t segment_size_;
+  std::size_t preamble_size_;
+  // the segment the writer has open
+  unsigned int write_segment_;
+  std::string pending_;
+  // offsets in [pending_] where the next segment starts
+  std::vector<std::size_t> rolls_;
+  // set once writing failed, nothing is recorded after that
+  bool failed_;
+  bool stopping_;
+  std::thread writer_;
+};
+
+#endif // ROOM_LOG_HPP
@@ -0,0 +1,181 @@
+//
+// server_metrics.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Counters and latency histograms the chat server keeps about itself.
+//
+
+#ifndef SERVER_METRICS_HPP
+#define SERVER_METRICS_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+  The latency_histogram class counts recorded values in log-linear buckets,
+  the way HdrHistogram does: values below 16 get a bucket each, and every
+  power of two above that is split into 16 buckets, so a percentile read back
+  is within 1/16 (about 6%) of the value that was recorded. The buckets are
+  fixed, so recording is one increment with no lock and no allocation and
+  any thread can record while another reads.
+*/
+class latency_histogram
+{
+public:
+  enum { sub_bits = 4 };
+  enum { sub_count = 1 << sub_bits };
+  enum { bucket_count = (64 - sub_bits + 1) * sub_count };
+
+  latency_histogram()
+    : count_(0),
+      sum_(0),
+      max_(0)
+  {
+    for (std::size_t i = 0; i < bucket_count; ++i)
+      buckets_[i] = 0;
+  }
+
+  void record(std::uint64_t value)
+  {
+    buckets_[index_of(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    std::uint64_t seen = max_.load(std::memory_order_relaxed);
+    while (value > seen
+        && !max_.compare_exchange_weak(seen, value, std::memory_order_relaxed))
+      ;
+  }
+
+  std::uint64_t count() const
+  {
+    return count_.load(std::memory_order_relaxed);
+  }
+
+  std::uint64_t sum() const
+  {
+    return sum_.load(std::memory_order_relaxed);
+  }
+
+  std::uint64_t max() const
+  {
+    return max_.load(std::memory_order_relaxed);
+  }
+
+  // The smallest value at least [p] percent of the recorded values are not
+  // above, rounded up to the top of its bucket. 0 when nothing was recorded.
+  std::uint64_t percentile(double p) const
+  {
+    std::uint64_t total = count();
+    if (total == 0)
+      return 0;
+    std::uint64_t rank = static_cast<std::uint64_t>(p / 100.0 * total + 0.5);
+    if (rank < 1)
+      rank = 1;
+    if (rank > total)
+      rank = total;
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < bucket_count; ++i)
+    {
+      seen += buckets_[i].load(std::memory_order_relaxed);
+      if (seen >= rank)
+      {
+        std::uint64_t top = highest_in(i);
+        return top < max() ? top : max();
+      }
+    }
+    return max();
+  }
+
+  // The bucket [value] is counted in
+  static std::size_t index_of(std::uint64_t value)
+  {
+    if (value < sub_count)
+      return value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - sub_bits;
+    return (shift + 1) * sub_count + ((value >> shift) & (sub_count - 1));
+  }
+
+  // The largest value counted in bucket [index]
+  static std::uint64_t highest_in(std::size_t index)
+  {
+    if (index < sub_count)
+      return index;
+    int shift = index / sub_count - 1;
+    std::uint64_t low = (std::uint64_t(sub_count) + index % sub_count) << shift;
+    return low + ((std::uint64_t(1) << shift) - 1);
+  }
+
+private:
+  std::atomic<std::uint64_t> buckets_[bucket_count];
+  std::atomic<std::uint64_t> count_;
+  std::atomic<std::uint64_t> sum_;
+  std::atomic<std::uint64_t> max_;
+};
+
+/*
+  The server_metrics struct holds what a chat server counts while it runs:
+  one latency histogram per command in nanoseconds, indexed like the
+  session's command table, and totals for the traffic and the sessions.
+  Everything is a relaxed atomic, so the hot paths pay one uncontended
+  increment and the readers see values that are each exact but not a
+  consistent snapshot of all of them.
+*/
+struct server_metrics
+{
+  enum { max_commands = 32 };
+
+  server_metrics()
+    : frames_in(0),
+      bytes_in(0),
+      frames_out(0),
+      bytes_out(0),
+      sessions_opened(0),
+      sessions_closed(0),
+      bad_checksums(0),
+      unknown_commands(0),
+      refused_commands(0)
+  {
+  }
+
+  latency_histogram commands[max_commands];
+  std::atomic<std::uint64_t> frames_in;
+  std::atomic<std::uint64_t> bytes_in;
+  std::atomic<std::uint64_t> frames_out;
+  std::atomic<std::uint64_t> bytes_out;
+  std::atomic<std::uint64_t> sessions_opened;
+  std::atomic<std::uint64_t> sessions_closed;
+  std::atomic<std::uint64_t> bad_checksums;
+  std::atomic<std::uint64_t> unknown_commands;
+  // admin commands from clients that are not admins
+  std::atomic<std::uint64_t> refused_commands;
+};
+
+// Appends "[key]=[value];" to [out], the format of every stats report line.
+inline void append_stat(std::string& out, const std::string& key,
+    std::uint64_t value)
+{
+  out += key;
+  out += '=';
+  out += std::to_string(value);
+  out += ';';
+}
+
+// Appends the count, mean, p50, p90, p99, p99.9 and max of [h] to [out] as
+// stats pairs named [prefix].count, [prefix].p50 and so on.
+inline void append_histogram(std::string& out, const std::string& prefix,
+    const latency_histogram& h)
+{
+  std::uint64_t count = h.count();
+  append_stat(out, prefix + ".count", count);
+  append_stat(out, prefix + ".mean", count ? h.sum() / count : 0);
+  append_stat(out, prefix + ".p50", h.percentile(50));
+  append_stat(out, prefix + ".p90", h.percentile(90));
+  append_stat(out, prefix + ".p99", h.percentile(99));
+  append_stat(out, prefix + ".p999", h.percentile(99.9));
+  append_stat(out, prefix + ".max", h.max());
+}
+
+#endif // SERVER_METRICS_HPP
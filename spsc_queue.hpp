@@ -0,0 +1,90 @@
+//
+// spsc_queue.hpp
+// ~~~~~~~~~~~~~~
+//
+// A bounded queue between exactly one producer and one consumer thread.
+//
+
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+/*
+  The spsc_queue class passes values from one thread to another through a
+  ring of [capacity] slots, rounded up to a power of two, without locks:
+  only the producer moves [tail_] and only the consumer moves [head_], so
+  each side needs one acquire load of the other's index and one release
+  store of its own. A full queue refuses the value instead of waiting, and
+  it is up to the producer what to do with it.
+
+  push may only ever be called from one thread and pop from one other.
+*/
+template <typename T>
+class spsc_queue
+{
+public:
+  explicit spsc_queue(std::size_t capacity)
+    : head_(0),
+      tail_(0)
+  {
+    std::size_t size = 2;
+    while (size < capacity)
+      size *= 2;
+    slots_.reset(new T[size]);
+    mask_ = size - 1;
+  }
+
+  // Moves [value] into the queue. Returns false, leaving [value] alone, when
+  // the queue is full.
+  bool push(T& value)
+  {
+    std::size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) > mask_)
+      return false;
+    slots_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Moves the oldest value into [value]. Returns false when the queue is
+  // empty.
+  bool pop(T& value)
+  {
+    std::size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire))
+      return false;
+    value = std::move(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // How many values are waiting; only exact on the consumer's thread when
+  // the producer is idle.
+  std::size_t size() const
+  {
+    return tail_.load(std::memory_order_acquire)
+      - head_.load(std::memory_order_acquire);
+  }
+
+  std::size_t capacity() const
+  {
+    return mask_ + 1;
+  }
+
+private:
+  spsc_queue(const spsc_queue&);
+  spsc_queue& operator=(const spsc_queue&);
+
+  std::unique_ptr<T[]> slots_;
+  std::size_t mask_;
+  // the consumer's and producer's positions, on separate cache lines so the
+  // two threads do not keep stealing the line from each other
+  alignas(64) std::atomic<std::size_t> head_;
+  alignas(64) std::atomic<std::size_t> tail_;
+};
+
+#endif // SPSC_QUEUE_HPP
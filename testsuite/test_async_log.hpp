@@ -0,0 +1,66 @@
+#include <string>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <assert.h>
+
+
+#include "../async_log.hpp"
+
+void test_async_log()
+{
+  bool passed = true;
+  std::FILE* out = std::tmpfile();
+  {
+    async_log log(out, 64);
+    log.set_level(log_info);
+    passed = passed && log.enabled(log_warn) && !log.enabled(log_debug);
+
+    log_line(log, log_info) << "room " << 7 << ' ' << std::string("created");
+    // a line that does not fit is cut off
+    log_line(log, log_error) << std::string(1000, 'x');
+
+    // four threads logging at once, the writer keeps up or counts drops
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+      threads.emplace_back([&log, t]()
+          {
+            for (int i = 0; i < 100; ++i)
+              log_line(log, log_debug) << "thread " << t << " line " << i;
+          });
+    for (auto& t: threads)
+      t.join();
+    log.stop();
+  }
+  std::rewind(out);
+  std::vector<std::string> lines;
+  char buf[1024];
+  while (std::fgets(buf, sizeof(buf), out))
+    lines.push_back(buf);
+  std::fclose(out);
+
+  passed = passed && lines.size() >= 3;
+  passed = passed && lines[0] == "INFO: room 7 created\n";
+  passed = passed && lines[1] == "ERROR: " + std::string(async_log::max_line, 'x') + "\n";
+  std::size_t logged = 0;
+  std::size_t dropped = 0;
+  for (std::size_t i = 2; i < lines.size(); ++i) {
+    unsigned long n;
+    if (lines[i].compare(0, 6, "DEBUG:") == 0)
+      ++logged;
+    else if (std::sscanf(lines[i].c_str(), "WARN: %lu log lines dropped", &n) == 1)
+      dropped += n;
+  }
+  passed = passed && logged + dropped == 400;
+
+  log_level level;
+  passed = passed && async_log::parse_level("trace", level) && level == log_trace;
+  passed = passed && !async_log::parse_level("loud", level);
+
+  if(passed) {
+    std::cout << "test_async_log: PASSED" << std::endl;
+  } else {
+    std::cout << "test_async_log: FAILED" << std::endl;
+  }
+}
@@ -0,0 +1,65 @@
+#include <map>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <assert.h>
+
+
+#include "../chat_connection.hpp"
+
+void test_chat_connection()
+{
+  bool passed = true;
+
+  std::vector<std::string> seen;
+  boost::string_view token = parse_reqtext_page("u1 hello there;u2 hi;+42",
+      [&seen](boost::string_view sender, boost::string_view text)
+      {
+        seen.push_back(std::string(sender) + "|" + std::string(text));
+      });
+  passed = passed && seen.size() == 2 && seen[0] == "u1|hello there"
+    && seen[1] == "u2|hi" && token == "42";
+
+  seen.clear();
+  token = parse_reqtext_page("", [&seen](boost::string_view, boost::string_view text)
+      {
+        seen.push_back(std::string(text));
+      });
+  passed = passed && seen.empty() && token.empty();
+
+  std::vector<chat_user> users = parse_user_list("abc,bob;def,;");
+  passed = passed && users.size() == 2 && users[0].uuid == "abc"
+    && users[0].name == "bob" && users[1].uuid == "def" && users[1].name == "";
+
+  std::vector<std::string> rooms = parse_room_list("a room;the lobby;");
+  passed = passed && rooms.size() == 2 && rooms[1] == "the lobby";
+  passed = passed && parse_room_list("").empty();
+
+  boost::string_view entries;
+  passed = passed && split_delta("3.17,=;+1,abc,bob;", entries) == "3.17"
+    && entries == "=;+1,abc,bob;";
+  passed = passed && split_delta("5", entries) == "5" && entries.empty();
+
+  std::map<unsigned long, chat_user> members;
+  apply_user_delta("=;+1,abc,bob;+2,def,;", members);
+  passed = passed && members.size() == 2 && members[1].name == "bob"
+    && members[2].uuid == "def";
+  apply_user_delta("-1;+2,def,al,ice;+3,ghi,carol;", members);
+  passed = passed && members.size() == 2 && members.count(1) == 0
+    && members[2].name == "al,ice" && members[3].uuid == "ghi";
+  apply_user_delta("=;", members);
+  passed = passed && members.empty();
+
+  rooms.clear();
+  apply_room_delta("=;+lobby;+games;", rooms);
+  apply_room_delta("+music;", rooms);
+  passed = passed && rooms.size() == 3 && rooms[2] == "music";
+  apply_room_delta("=;+lobby;", rooms);
+  passed = passed && rooms.size() == 1 && rooms[0] == "lobby";
+
+  if(passed) {
+    std::cout << "test_chat_connection: PASSED" << std::endl;
+  } else {
+    std::cout << "test_chat_connection: FAILED" << std::endl;
+  }
+}
@@ -0,0 +1,63 @@
+#include <string>
+#include <iostream>
+#include <assert.h>
+
+
+#include "../chat_message.hpp"
+
+// Copies the [version] framing of [msg] into the header buffer of [in] the
+// way a session reads it and decodes it, then returns the body it got.
+std::string frame_round_trip(const chat_message& msg, int version, chat_message& in)
+{
+  std::string wire = version == 2
+    ? std::string(msg.v2_header(), msg.v2_header_length())
+    : std::string(msg.data(), chat_message::header_length);
+  std::size_t have = chat_message::header_length;
+  std::memcpy(in.header_buffer(), wire.data(), have);
+  while(std::size_t more = in.missing_header_bytes(have)) {
+    std::memcpy(in.header_buffer() + have, wire.data() + have, more);
+    have += more;
+  }
+  if(have != wire.size() || !in.decode_header(have)) {
+    return "<bad header>";
+  }
+  std::memcpy(in.body(), msg.body(), in.body_length());
+  return std::string(in.body(), in.body_length());
+}
+
+void test_chat_message()
+{
+  bool passed = true;
+  chat_message in;
+
+  // v1 keeps the old ASCII header
+  chat_message small;
+  small.body_length(5);
+  std::memcpy(small.body(), "hello", 5);
+  small.encode_header();
+  passed = passed && std::string(small.data(), small.length()) == "   5hello";
+  passed = passed && frame_round_trip(small, 1, in) == "hello" && in.version() == 1;
+  passed = passed && frame_round_trip(small, 2, in) == "hello" && in.version() == 2;
+
+  // v2 carries bodies past the v1 limit, v1 cuts them off as before
+  std::string text(70000, 'x');
+  chat_message big;
+  big.body_length(text.size());
+  std::memcpy(big.body(), text.data(), text.size());
+  big.encode_header();
+  passed = passed && big.length() == chat_message::header_length + chat_message::max_body_length;
+  passed = passed && big.v2_header_length() == 5;
+  passed = passed && frame_round_trip(big, 2, in) == text;
+
+  // a v1 header over the limit or with junk in it is refused
+  std::memcpy(in.header_buffer(), " 513", 4);
+  passed = passed && !in.decode_header();
+  std::memcpy(in.header_buffer(), "12a4", 4);
+  passed = passed && !in.decode_header();
+
+  if(passed) {
+    std::cout << "test_chat_message: PASSED" << std::endl;
+  } else {
+    std::cout << "test_chat_message: FAILED" << std::endl;
+  }
+}
@@ -0,0 +1,39 @@
+#include <string>
+#include <iostream>
+#include <assert.h>
+
+
+#include "../util.hpp"
+
+void test_checksum()
+{
+  bool passed = true;
+
+  // the standard CRC-32C check value, from both implementations
+  passed = passed && crc32c_sw(0, "123456789", 9) == 0xE3069283;
+  passed = passed && crc32c(0, "123456789", 9) == 0xE3069283;
+  std::string long_text(1000, 'q');
+  passed = passed && crc32c_sw(0, long_text.data(), 1000) == crc32c(0, long_text.data(), 1000);
+
+  // verify_checksum agrees with the string based checksum of format_request
+  std::string line = format_request("SENDTEXT", "This is a test message.");
+  passed = passed && checkCheckSum(line) == TRUE;
+  passed = passed && verify_checksum(line.data(), line.size());
+  passed = passed && !verify_checksum(line.data(), line.size(), checksum_crc32c);
+
+  std::string line_c = format_request("REQTEXT", "", checksum_crc32c);
+  passed = passed && verify_checksum(line_c.data(), line_c.size(), checksum_crc32c);
+
+  // a changed byte or a checksum that is not hex is caught
+  std::string tampered = line;
+  tampered[tampered.size() - 1] = '!';
+  passed = passed && !verify_checksum(tampered.data(), tampered.size());
+  std::string not_hex = "xyz" + line.substr(line.find(','));
+  passed = passed && !verify_checksum(not_hex.data(), not_hex.size());
+
+  if(passed) {
+    std::cout << "test_checksum: PASSED" << std::endl;
+  } else {
+    std::cout << "test_checksum: FAILED" << std::endl;
+  }
+}
@@ -0,0 +1,28 @@
+#include <string>
+#include <iostream>
+#include <assert.h>
+
+
+#include "../util.hpp"
+
+void test_command_parser()
+{
+  bool passed = true;
+  command_line cmd;
+
+  passed = passed && parse_command("ffffffff,123456.123456,SENDTEXT,this is, a test", cmd);
+  passed = passed && cmd.checksum == "ffffffff" && cmd.time == "123456.123456";
+  passed = passed && cmd.command == "SENDTEXT" && cmd.args == "this is, a test";
+
+  passed = passed && parse_command("ffffffff,123456.123456,REQTEXT", cmd);
+  passed = passed && cmd.command == "REQTEXT" && cmd.args.empty();
+
+  passed = passed && !parse_command("ffffffff,123456.123456", cmd);
+  passed = passed && !parse_command("garbage", cmd);
+
+  if(passed) {
+    std::cout << "test_command_parser: PASSED" << std::endl;
+  } else {
+    std::cout << "test_command_parser: FAILED" << std::endl;
+  }
+}
@@ -0,0 +1,49 @@
+#include <string>
+#include <vector>
+#include <iostream>
+#include <assert.h>
+
+
+#include "../frame_deflate.hpp"
+#include "../util.hpp"
+
+void test_frame_deflate()
+{
+  bool passed = true;
+
+  std::vector<chat_message_ptr> frames;
+  std::size_t plain = 0;
+  for(int i = 0; i < 50; i++) {
+    frames.push_back(make_request_message("REQTEXT",
+          "0f8fad5b-d9cb-469f-a165-70867728950e message " + std::to_string(i) + ";"));
+    plain += frames.back()->v2_header_length() + frames.back()->body_length();
+  }
+
+  // the batch is a v2 deflate frame and much smaller than the frames
+  chat_message_ptr batch = deflate_frames(frames);
+  passed = passed && batch && batch->type() == chat_message::v2_deflate;
+  passed = passed && batch && batch->body_length() < plain / 4;
+
+  // inflating gives back the same frames in order
+  std::size_t count = 0;
+  passed = passed && batch && inflate_frames(*batch,
+      [&](const chat_message& frame)
+      {
+        const chat_message& sent = *frames[count++];
+        passed = passed && frame.body_length() == sent.body_length()
+          && std::memcmp(frame.body(), sent.body(), sent.body_length()) == 0;
+      });
+  passed = passed && count == frames.size();
+
+  // a damaged batch or one over the size limit is rejected
+  chat_message damaged = *batch;
+  damaged.body()[damaged.body_length() / 2] ^= 0x55;
+  passed = passed && !inflate_frames(damaged, [](const chat_message&) {});
+  passed = passed && !inflate_frames(*batch, [](const chat_message&) {}, 100);
+
+  if(passed) {
+    std::cout << "test_frame_deflate: PASSED" << std::endl;
+  } else {
+    std::cout << "test_frame_deflate: FAILED" << std::endl;
+  }
+}
@@ -0,0 +1,46 @@
+#include <string>
+#include <iostream>
+#include <assert.h>
+
+
+#include "../name_registry.hpp"
+
+void test_name_registry()
+{
+  bool passed = true;
+  name_registry names;
+
+  passed = passed && names.claim("bob", 1);
+  passed = passed && names.claim("bob", 1);
+  passed = passed && !names.claim("bob", 2);
+  passed = passed && names.taken("bob") && !names.taken("alice");
+
+  // taken names get a number, and the numbers keep counting
+  passed = passed && names.suggest("alice") == "alice";
+  passed = passed && names.suggest("bob") == "bob2";
+  passed = passed && names.claim("bob2", 2);
+  passed = passed && names.suggest("bob") == "bob3";
+  passed = passed && names.claim("bob3", 3);
+
+  // only the holder can release a name
+  names.release("bob", 2);
+  passed = passed && names.taken("bob");
+  names.release("bob", 1);
+  passed = passed && !names.taken("bob") && names.size() == 2;
+  passed = passed && names.claim("bob", 4);
+
+  // the counter for "bob" goes once nobody holds bob, bob2 or bob3
+  passed = passed && names.suffixes() == 1;
+  names.release("bob", 4);
+  names.release("bob2", 2);
+  passed = passed && names.suffixes() == 1;
+  names.release("bob3", 3);
+  passed = passed && names.suffixes() == 0 && names.size() == 0;
+  passed = passed && names.claim("bob", 5) && names.suggest("bob") == "bob2";
+
+  if(passed) {
+    std::cout << "test_name_registry: PASSED" << std::endl;
+  } else {
+    std::cout << "test_name_registry: FAILED" << std::endl;
+  }
+}
@@ -0,0 +1,60 @@
+#include <string>
+#include <iostream>
+#include <assert.h>
+
+
+#include "../util.hpp"
+
+void test_request_encoder()
+{
+  bool passed = true;
+
+  // the time field looks like to_iso_string of a microsecond clock
+  char tm[request_clock::stamp_length];
+  request_clock::stamp(tm);
+  std::string stamp(tm, sizeof(tm));
+  std::string iso = boost::posix_time::to_iso_string(
+      boost::posix_time::microsec_clock::local_time());
+  passed = passed && stamp.substr(0, 9) == iso.substr(0, 9);
+  passed = passed && stamp[8] == 'T' && stamp[15] == '.';
+
+  // the encoded line is checksum,time,command,data with a valid checksum
+  chat_message msg;
+  encode_request(msg, "SENDTEXT", "This is a test message.");
+  std::string line(msg.body(), msg.body_length());
+  command_line cmd;
+  passed = passed && parse_command(line, cmd);
+  passed = passed && cmd.time.size() == request_clock::stamp_length;
+  passed = passed && cmd.command == "SENDTEXT";
+  passed = passed && cmd.args == "This is a test message.";
+  passed = passed && checkCheckSum(line) == TRUE;
+  passed = passed && msg.length() == chat_message::header_length + line.size();
+
+  // no data means no trailing comma, and crc32c lines verify as crc32c
+  chat_message_ptr reply = make_request_message("REQTEXT", "",
+      checksum_crc32c);
+  std::string reply_line(reply->body(), reply->body_length());
+  passed = passed && reply_line.substr(reply_line.size() - 8) == ",REQTEXT";
+  passed = passed && verify_checksum(reply_line.data(), reply_line.size(),
+      checksum_crc32c);
+
+  // data right at the largest v2 body fits whole, anything more is cut to
+  // fit, still with a valid checksum, instead of overrunning the body
+  chat_message big;
+  std::size_t overhead = std::string(",,SENDTEXT,").size() + request_clock::stamp_length;
+  std::string at_cap(chat_message::max_v2_body_length - overhead - 8, 'x');
+  passed = passed && encode_request(big, "SENDTEXT", at_cap);
+  passed = passed && big.body_length() <= chat_message::max_v2_body_length;
+  passed = passed && verify_checksum(big.body(), big.body_length());
+  std::string over_cap(chat_message::max_v2_body_length + 100, 'x');
+  passed = passed && !encode_request(big, "SENDTEXT", over_cap);
+  passed = passed && big.body_length() <= chat_message::max_v2_body_length;
+  passed = passed && verify_checksum(big.body(), big.body_length());
+  passed = passed && !encode_request(big, "SENDTEXT", at_cap + "x");
+
+  if(passed) {
+    std::cout << "test_request_encoder: PASSED" << std::endl;
+  } else {
+    std::cout << "test_request_encoder: FAILED" << std::endl;
+  }
+}
@@ -0,0 +1,81 @@
+#include <string>
+#include <iostream>
+#include <assert.h>
+
+
+#include "../room_history.hpp"
+#include "../util.hpp"
+
+chat_message_ptr history_message(std::string text)
+{
+  std::shared_ptr<chat_message> msg = std::make_shared<chat_message>();
+  msg->body_length(text.length());
+  std::memcpy(msg->body(), text.c_str(), msg->body_length());
+  msg->encode_header();
+  return msg;
+}
+
+void test_room_history()
+{
+  bool passed = true;
+
+  // message limit: only the newest three survive, sequence numbers keep going
+  room_history by_count(3, 0);
+  for(int i = 0; i < 10; i++) {
+    by_count.push_back(history_message("m" + std::to_string(i)));
+  }
+  passed = passed && by_count.size() == 3;
+  passed = passed && by_count.first_seq() == 7 && by_count.end_seq() == 10;
+  passed = passed && std::string(by_count.at(7)->body(), 2) == "m7";
+  passed = passed && std::string(by_count.at(9)->body(), 2) == "m9";
+  // a cursor pointing at evicted messages resumes at the oldest kept one
+  passed = passed && by_count.clamp(2) == 7 && by_count.clamp(8) == 8;
+
+  // byte limit: 10 bytes holds two 4 byte messages
+  room_history by_bytes(100, 10);
+  for(int i = 0; i < 5; i++) {
+    by_bytes.push_back(history_message("abc" + std::to_string(i)));
+  }
+  passed = passed && by_bytes.size() == 2 && by_bytes.bytes() == 8;
+  passed = passed && std::string(by_bytes.at(4)->body(), 4) == "abc4";
+
+  // pages hold whole messages up to the budget and say where to go on
+  std::string page;
+  passed = passed && by_count.page(0, 4, page) == 9 && page == "m7m8";
+  page.clear();
+  passed = passed && by_count.page(9, 4, page) == 10 && page == "m9";
+  page.clear();
+  passed = passed && by_count.page(7, 1, page) == 8 && page == "m7";
+  page.clear();
+  passed = passed && by_count.page(10, 4, page) == 10 && page == "";
+  // paging at the v1 limit: a message over the page budget, like one from a
+  // v2 client, comes as a notice and the REQTEXT frame still fits 512 bytes
+  std::string uuid(36, 'u');
+  room_history at_limit(10, 0);
+  at_limit.push_back(history_message(uuid + " " + std::string(460, 'x') + ";"));
+  at_limit.push_back(history_message(uuid + " " + std::string(410, 'y') + ";"));
+  at_limit.push_back(history_message(uuid + " hi;"));
+  std::string v1_page;
+  std::size_t next = at_limit.fitted_page(0, room_history::v1_page_bytes, v1_page);
+  passed = passed && next == 1
+    && v1_page == uuid + " [498 byte message not shown];";
+  for(std::size_t seq = 0; seq < at_limit.end_seq(); seq = next) {
+    v1_page.clear();
+    next = at_limit.fitted_page(seq, room_history::v1_page_bytes, v1_page);
+    passed = passed && next > seq && v1_page.size() <= room_history::v1_page_bytes;
+    if(next < at_limit.end_seq()) {
+      v1_page += "+" + std::to_string(std::size_t(-1));
+    }
+    chat_message_ptr frame = make_request_message("REQTEXT", v1_page);
+    passed = passed && frame->body_length() <= chat_message::max_body_length
+      && verify_checksum(frame->body(), frame->body_length());
+  }
+  // the biggest text a v1 client may send fits a page on its own
+  passed = passed && at_limit.at(1)->body_length() <= room_history::v1_page_bytes;
+
+  if(passed) {
+    std::cout << "test_room_history: PASSED" << std::endl;
+  } else {
+    std::cout << "test_room_history: FAILED" << std::endl;
+  }
+}
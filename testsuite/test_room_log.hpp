@@ -0,0 +1,162 @@
+#include <string>
+#include <iostream>
+#include <assert.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+
+#include "../room_log.hpp"
+
+void test_room_log()
+{
+  char dir[] = "/tmp/room_log_testXXXXXX";
+  bool passed = mkdtemp(dir) != NULL;
+
+  // write a room and two messages, the destructor flushes them to disk
+  {
+    room_log log(dir);
+    log.start();
+    log.append_room("r1");
+    log.append_message("r1", "uuid hi;", 8);
+    log.append_message("the lobby", "uuid yo;", 8);
+  }
+
+  // and a fresh log over the same directory reads them back in order
+  std::string seen;
+  room_log log(dir);
+  std::size_t records = log.replay(
+      [&seen](const std::string& room) { seen += "R:" + room + "|"; },
+      [&seen](const std::string& room, const char* body, std::size_t length)
+      {
+        seen += "M:" + room + ":" + std::string(body, length) + "|";
+      });
+  passed = passed && records == 3;
+  passed = passed && seen == "R:r1|M:r1:uuid hi;|M:the lobby:uuid yo;|";
+
+  std::remove((std::string(dir) + "/segment-00000001.log").c_str());
+
+  // with tiny segments every message starts a new one, which repeats the
+  // rooms first, so the old segments can go and the rooms survive
+  {
+    room_log small(dir, 40);
+    small.start();
+    small.append_room("r1");
+    unsigned int first = small.append_message("r1", "uuid one;", 9);
+    unsigned int second = small.append_message("r1", "uuid two;", 9);
+    unsigned int third = small.append_message("r1", "uuid three;", 11);
+    passed = passed && first == 1 && second == 2 && third == 3;
+    // a room name too long for the record is refused, not cut short
+    passed = passed && small.append_message(std::string(70000, 'r'), "x", 1) == 0;
+    // let the writer catch up so segment 3 is the one it has open
+    for(int i = 0; i < 100; i++) {
+      struct stat st;
+      if(stat((std::string(dir) + "/segment-00000003.log").c_str(), &st) == 0
+          && st.st_size > 0) {
+        break;
+      }
+      usleep(10000);
+    }
+    small.drop_before(3);
+  }
+  seen.clear();
+  room_log after(dir, 40);
+  records = after.replay(
+      [&seen](const std::string& room) { seen += "R:" + room + "|"; },
+      [&seen](const std::string& room, const char* body, std::size_t length)
+      {
+        seen += "M:" + room + ":" + std::string(body, length) + "|";
+      });
+  passed = passed && records == 2 && seen == "R:r1|M:r1:uuid three;|";
+  passed = passed && after.replaying() == 3;
+  struct stat gone;
+  passed = passed && stat((std::string(dir) + "/segment-00000002.log").c_str(), &gone) != 0;
+
+  std::remove((std::string(dir) + "/segment-00000003.log").c_str());
+
+  // rooms whose records alone fill a segment still get one segment each
+  // roll, and a roll started by a new room lists that room once
+  {
+    room_log rooms(dir, 40);
+    rooms.start();
+    rooms.append_room("room-a");
+    rooms.append_room("room-b");
+    rooms.append_room("room-c");
+    rooms.append_room("room-d");
+    passed = passed && rooms.append_message("room-d", "x;", 2) == 4;
+    for(int i = 0; i < 100; i++) {
+      struct stat st;
+      if(stat((std::string(dir) + "/segment-00000004.log").c_str(), &st) == 0
+          && st.st_size > 0) {
+        break;
+      }
+      usleep(10000);
+    }
+    rooms.drop_before(4);
+  }
+  seen.clear();
+  room_log rolled(dir, 40);
+  records = rolled.replay(
+      [&seen](const std::string& room) { seen += "R:" + room + "|"; },
+      [&seen](const std::string& room, const char* body, std::size_t length)
+      {
+        seen += "M:" + room + ":" + std::string(body, length) + "|";
+      });
+  passed = passed && records == 5
+    && seen == "R:room-a|R:room-b|R:room-c|R:room-d|M:room-d:x;|";
+
+  std::remove((std::string(dir) + "/segment-00000004.log").c_str());
+
+  // a write that fails half way is cut off the segment, counted, and the
+  // log records nothing after it
+  std::string segment = std::string(dir) + "/segment-00000001.log";
+  {
+    room_log full(dir);
+    full.start();
+    full.append_room("r1");
+    for(int i = 0; i < 100; i++) {
+      struct stat st;
+      if(stat(segment.c_str(), &st) == 0 && st.st_size > 0) {
+        break;
+      }
+      usleep(10000);
+    }
+    usleep(50000);
+    // files may not grow past 1 MiB, so a 2 MiB message only half fits
+    struct rlimit old_limit, limit;
+    getrlimit(RLIMIT_FSIZE, &old_limit);
+    limit = old_limit;
+    limit.rlim_cur = 1024 * 1024;
+    setrlimit(RLIMIT_FSIZE, &limit);
+    void (*old_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+    std::string big(2 * 1024 * 1024, 'x');
+    passed = passed && full.append_message("r1", big.data(), big.size()) == 1;
+    for(int i = 0; i < 100 && full.failures() == 0; i++) {
+      usleep(10000);
+    }
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    signal(SIGXFSZ, old_handler);
+    passed = passed && full.failures() == 1;
+    passed = passed && full.append_message("r1", "uuid late;", 10) == 0;
+  }
+  seen.clear();
+  room_log cut(dir);
+  records = cut.replay(
+      [&seen](const std::string& room) { seen += "R:" + room + "|"; },
+      [&seen](const std::string& room, const char* body, std::size_t length)
+      {
+        seen += "M:" + room + ":" + std::string(body, length) + "|";
+      });
+  struct stat cut_size;
+  passed = passed && records == 1 && seen == "R:r1|"
+    && stat(segment.c_str(), &cut_size) == 0 && cut_size.st_size == 11;
+
+  std::remove(segment.c_str());
+  rmdir(dir);
+
+  if(passed) {
+    std::cout << "test_room_log: PASSED" << std::endl;
+  } else {
+    std::cout << "test_room_log: FAILED" << std::endl;
+  }
+}
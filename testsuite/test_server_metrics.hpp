@@ -0,0 +1,47 @@
+#include <string>
+#include <iostream>
+#include <assert.h>
+
+
+#include "../server_metrics.hpp"
+
+void test_server_metrics()
+{
+  bool passed = true;
+  latency_histogram h;
+
+  passed = passed && h.count() == 0 && h.percentile(50) == 0;
+
+  // small values are exact, larger ones within 1/16
+  passed = passed && latency_histogram::highest_in(latency_histogram::index_of(7)) == 7;
+  for (std::uint64_t v = 16; v < 100000; v = v * 3 + 1) {
+    std::uint64_t top = latency_histogram::highest_in(latency_histogram::index_of(v));
+    passed = passed && top >= v && top - v <= v / 16;
+  }
+  passed = passed && latency_histogram::index_of(UINT64_MAX)
+    < latency_histogram::bucket_count;
+
+  for (std::uint64_t v = 1; v <= 1000; ++v)
+    h.record(v * 1000);
+  passed = passed && h.count() == 1000 && h.max() == 1000000;
+  passed = passed && h.sum() == 500500000;
+  std::uint64_t p50 = h.percentile(50);
+  std::uint64_t p99 = h.percentile(99);
+  passed = passed && p50 >= 500000 && p50 <= 500000 + 500000 / 16;
+  passed = passed && p99 >= 990000 && p99 <= 1000000;
+  passed = passed && h.percentile(100) == 1000000;
+
+  std::string out;
+  append_stat(out, "frames.in", 3);
+  passed = passed && out == "frames.in=3;";
+  out.clear();
+  append_histogram(out, "cmd.X", h);
+  passed = passed && out.find("cmd.X.count=1000;") == 0;
+  passed = passed && out.find("cmd.X.max=1000000;") != std::string::npos;
+
+  if(passed) {
+    std::cout << "test_server_metrics: PASSED" << std::endl;
+  } else {
+    std::cout << "test_server_metrics: FAILED" << std::endl;
+  }
+}
@@ -0,0 +1,62 @@
+#include <string>
+#include <iostream>
+#include <thread>
+#include <assert.h>
+
+
+#include "../spsc_queue.hpp"
+
+void test_spsc_queue()
+{
+  bool passed = true;
+
+  spsc_queue<std::string> queue(3);
+  passed = passed && queue.capacity() == 4 && queue.size() == 0;
+  std::string value;
+  passed = passed && !queue.pop(value);
+  for (int i = 0; i < 4; ++i)
+  {
+    value = "line " + std::to_string(i);
+    passed = passed && queue.push(value);
+  }
+  // a full queue refuses the value and leaves it with the caller
+  value = "extra";
+  passed = passed && !queue.push(value) && value == "extra";
+  passed = passed && queue.pop(value) && value == "line 0" && queue.size() == 3;
+  value = "line 4";
+  passed = passed && queue.push(value);
+  for (int i = 1; i <= 4; ++i)
+    passed = passed && queue.pop(value) && value == "line " + std::to_string(i);
+  passed = passed && !queue.pop(value);
+
+  // one thread pushing through a small queue while this one pops, in order
+  spsc_queue<int> numbers(16);
+  const int count = 100000;
+  std::thread producer([&numbers]()
+      {
+        for (int i = 0; i < count; ++i)
+          while (!numbers.push(i))
+            std::this_thread::yield();
+      });
+  int expected = 0;
+  while (expected < count)
+  {
+    int n;
+    if (!numbers.pop(n))
+    {
+      std::this_thread::yield();
+      continue;
+    }
+    if (n != expected)
+      passed = false;
+    ++expected;
+  }
+  producer.join();
+  passed = passed && numbers.size() == 0;
+
+  if(passed) {
+    std::cout << "test_spsc_queue: PASSED" << std::endl;
+  } else {
+    std::cout << "test_spsc_queue: FAILED" << std::endl;
+  }
+}
@@ -0,0 +1,29 @@
+#include <string>
+#include <set>
+#include <iostream>
+#include <assert.h>
+
+
+#include "../util.hpp"
+
+void test_uuid()
+{
+  bool passed = true;
+  std::set<std::string> seen;
+
+  // more than one batch, all well formed version 4 uuids and all different
+  for(int i = 0; i < 3 * uuid_pool::batch; i++) {
+    std::string s = gen_uuid();
+    boost::uuids::uuid parsed = boost::uuids::string_generator()(s);
+    passed = passed && s.size() == 36 && boost::uuids::to_string(parsed) == s;
+    passed = passed && parsed.version() == boost::uuids::uuid::version_random_number_based;
+    passed = passed && parsed.variant() == boost::uuids::uuid::variant_rfc_4122;
+    passed = passed && seen.insert(s).second;
+  }
+
+  if(passed) {
+    std::cout << "test_uuid: PASSED" << std::endl;
+  } else {
+    std::cout << "test_uuid: FAILED" << std::endl;
+  }
+}
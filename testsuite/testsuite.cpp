@@ -1,5 +1,18 @@
 #include "test_command_formatting.hpp"
 #include "test_build_message.hpp"
+#include "test_room_history.hpp"
+#include "test_room_log.hpp"
+#include "test_chat_message.hpp"
+#include "test_command_parser.hpp"
+#include "test_checksum.hpp"
+#include "test_request_encoder.hpp"
+#include "test_name_registry.hpp"
+#include "test_uuid.hpp"
+#include "test_frame_deflate.hpp"
+#include "test_server_metrics.hpp"
+#include "test_async_log.hpp"
+#include "test_chat_connection.hpp"
+#include "test_spsc_queue.hpp"
 #include <iostream>
 #include <string>
 
@@ -8,5 +21,18 @@ int main()
 {
   test_formatting();
   test_build_message();
+  test_room_history();
+  test_room_log();
+  test_chat_message();
+  test_command_parser();
+  test_checksum();
+  test_request_encoder();
+  test_name_registry();
+  test_uuid();
+  test_frame_deflate();
+  test_server_metrics();
+  test_async_log();
+  test_chat_connection();
+  test_spsc_queue();
   return 0;
 }
@@ -1,3 +1,6 @@
+#ifndef UTIL_HPP
+#define UTIL_HPP
+
 // from stack overflow
 // http://stackoverflow.com/questions/3247861/example-of-uuid-generation-using-boost-in-c
 #include <boost/uuid/uuid.hpp>            // uuid class
@@ -5,26 +8,103 @@
 #include <boost/uuid/uuid_io.hpp>         // streaming operators etc.
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/utility/string_view.hpp>
+#include <chrono>
+#include <ctime>
+#include <stdexcept>
 #include <string>
 #include <zlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <iomanip>
 #include <sstream>
 
 #include "chat_message.hpp"
+#include "crc32c.hpp"
 
-#define DEBUG_MODE true
 #define CHECKSUM_VALIDATION true
 
 #define TRUE 1
 #define FALSE 0
 
 /*
-  This function uses the boost library to generate a uuid and
+  The uuid_pool class hands out random (version 4) uuids. Building a
+  boost random_generator for every uuid seeds it from the system each
+  time, which is slow when many clients connect at once. Instead every
+  thread keeps a pool of random bytes from /dev/urandom, refilled once
+  every [batch] uuids, and cuts the uuids from it.
+*/
+class uuid_pool
+{
+public:
+  enum { batch = 256 };
+
+  // The pool of the calling thread
+  static uuid_pool& local() {
+    static thread_local uuid_pool pool;
+    return pool;
+  }
+
+  boost::uuids::uuid next() {
+    if(used_ == batch) {
+      refill();
+    }
+    boost::uuids::uuid uuid;
+    std::memcpy(uuid.data, bytes_ + used_ * 16, 16);
+    std::memset(bytes_ + used_ * 16, 0, 16);
+    used_++;
+    // mark it as a random uuid of the RFC 4122 variant
+    uuid.data[6] = (uuid.data[6] & 0x0f) | 0x40;
+    uuid.data[8] = (uuid.data[8] & 0x3f) | 0x80;
+    return uuid;
+  }
+
+private:
+  uuid_pool() : used_(batch) {}
+
+  void refill() {
+    int fd = ::open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+      throw std::runtime_error("gen_uuid: cannot open /dev/urandom");
+    }
+    std::size_t got = 0;
+    while(got < sizeof(bytes_)) {
+      ssize_t n = ::read(fd, bytes_ + got, sizeof(bytes_) - got);
+      if(n < 0 && errno == EINTR) {
+        continue;
+      }
+      if(n <= 0) {
+        ::close(fd);
+        throw std::runtime_error("gen_uuid: cannot read /dev/urandom");
+      }
+      got += n;
+    }
+    ::close(fd);
+    used_ = 0;
+  }
+
+  unsigned char bytes_[batch * 16];
+  std::size_t used_;
+};
+
+/*
+  This function takes the next uuid from the thread's uuid_pool and
   returns it in as a string.
 */
 std::string gen_uuid() {
-    boost::uuids::uuid uuid = boost::uuids::random_generator()();
-    return boost::uuids::to_string(uuid);
+    boost::uuids::uuid uuid = uuid_pool::local().next();
+    // the usual 8-4-4-4-12 lowercase hex form, as boost::uuids::to_string
+    std::string s(36, '-');
+    std::size_t pos = 0;
+    for(std::size_t i = 0; i < 16; i++) {
+      if(pos == 8 || pos == 13 || pos == 18 || pos == 23) {
+        pos++;
+      }
+      s[pos++] = "0123456789abcdef"[uuid.data[i] >> 4];
+      s[pos++] = "0123456789abcdef"[uuid.data[i] & 0xf];
+    }
+    return s;
 }
 
 /*
@@ -59,6 +139,79 @@ unsigned int gen_crc32(std::string data) {
    return crc;
 }
 
+/*
+  The checksums a connection can use. Every connection starts with crc32;
+  a client can ask for crc32c with "CHECKSUM,CRC32C", which is cheaper on CPUs
+  with SSE4.2.
+*/
+enum checksum_kind { checksum_crc32, checksum_crc32c };
+
+/*
+  The update_checksum function continues the [kind] checksum [crc] over
+  [length] more bytes at [data], so a line can be checksummed piece by piece.
+  Start from 0.
+*/
+unsigned int update_checksum(unsigned int crc, const char* data,
+    std::size_t length, checksum_kind kind = checksum_crc32) {
+  if(kind == checksum_crc32c) {
+    return crc32c(crc, data, length);
+  }
+  return crc32(crc, (const unsigned char*) data, length);
+}
+
+/*
+  The gen_checksum function computes the [kind] checksum of [length] bytes at
+  [data] followed by a terminating '\0', the same bytes gen_crc32 covers for a
+  string, without needing the bytes to be a string or be terminated.
+*/
+unsigned int gen_checksum(const char* data, std::size_t length,
+    checksum_kind kind = checksum_crc32) {
+  static const char terminator = '\0';
+  return update_checksum(update_checksum(0, data, length, kind),
+      &terminator, 1, kind);
+}
+
+/*
+  The request_clock struct produces the time field of a line,
+  "YYYYMMDDTHHMMSS.ffffff" in local time like to_iso_string gives. The
+  date and time part only changes once a second, so each thread keeps it
+  formatted and only calls localtime_r again when the second changes;
+  stamping a line is then a clock read and six digits.
+*/
+struct request_clock
+{
+  enum { stamp_length = 22 };
+
+  // Writes the current time to [out], which must hold stamp_length chars.
+  static void stamp(char* out) {
+    static thread_local request_clock cache;
+    std::chrono::microseconds now =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch());
+    std::time_t second = now.count() / 1000000;
+    long micros = now.count() % 1000000;
+    if(second != cache.second) {
+      struct tm local;
+      localtime_r(&second, &local);
+      std::strftime(cache.seconds, sizeof(cache.seconds), "%Y%m%dT%H%M%S",
+          &local);
+      cache.second = second;
+    }
+    std::memcpy(out, cache.seconds, 15);
+    out[15] = '.';
+    for(int i = stamp_length - 1; i > 15; i--) {
+      out[i] = '0' + micros % 10;
+      micros /= 10;
+    }
+  }
+
+private:
+  request_clock() : second(-1) {}
+
+  std::time_t second;
+  char seconds[16];
+};
+
 /*
   This function takes a vector of strings passed by reference [strs] to avoid
   copying and an integer [start]. It loops through the vector from the position
@@ -97,6 +250,79 @@ std::string build_line_no_checksum (std::vector<std::string> const &strs, int st
   return m;
 }
 
+/*
+  The command_line struct holds the fields of a received line
+    checksum,time,COMMAND[,arguments]
+  as views into the receive buffer, so parsing a line copies nothing.
+  [args] is everything after the comma that follows the command, commas
+  and spaces included, and is empty when there is no argument.
+*/
+struct command_line
+{
+  boost::string_view checksum;
+  boost::string_view time;
+  boost::string_view command;
+  boost::string_view args;
+};
+
+/*
+  The parse_command function splits [line] into [out] in a single pass.
+  Returns false if the line does not have the checksum, time and command
+  fields. The views in [out] point into [line] and live as long as it does.
+*/
+bool parse_command(boost::string_view line, command_line& out) {
+  boost::string_view* fields[] = { &out.checksum, &out.time, &out.command };
+  std::size_t start = 0;
+  for(int i = 0; i < 3; i++) {
+    std::size_t comma = line.find(',', start);
+    if(i == 2) {
+      *fields[i] = line.substr(start, comma == boost::string_view::npos
+          ? boost::string_view::npos : comma - start);
+      out.args = comma == boost::string_view::npos
+        ? boost::string_view() : line.substr(comma + 1);
+    } else if(comma == boost::string_view::npos) {
+      return false;
+    } else {
+      *fields[i] = line.substr(start, comma - start);
+    }
+    start = comma + 1;
+  }
+  return !out.command.empty();
+}
+
+/*
+  The verify_checksum function checks a received line in place.
+  inputs:
+    [length] bytes at [line] in format checksum,time,majorcommand,optional
+    arguement(if present), and the [kind] of checksum the connection uses
+  output:
+    true if the hex checksum before the first comma matches the checksum of
+    everything from that comma on, false otherwise or if it is not hex
+*/
+bool verify_checksum(const char* line, std::size_t length,
+    checksum_kind kind = checksum_crc32) {
+  const char* comma = static_cast<const char*>(std::memchr(line, ',', length));
+  if(!comma || comma == line || comma - line > 8) {
+    return false;
+  }
+  unsigned int expected = 0;
+  for(const char* p = line; p != comma; p++) {
+    char c = *p;
+    unsigned int digit;
+    if(c >= '0' && c <= '9') {
+      digit = c - '0';
+    } else if(c >= 'a' && c <= 'f') {
+      digit = c - 'a' + 10;
+    } else if(c >= 'A' && c <= 'F') {
+      digit = c - 'A' + 10;
+    } else {
+      return false;
+    }
+    expected = (expected << 4) | digit;
+  }
+  return gen_checksum(comma, line + length - comma, kind) == expected;
+}
+
 /*
   checks checksum data from server
   inputs:
@@ -109,62 +335,121 @@ std::string build_line_no_checksum (std::vector<std::string> const &strs, int st
 */
 int checkCheckSum(std::string input)
 {
-  std::string generatedCheckSum;
+  return verify_checksum(input.data(), input.size()) ? TRUE : FALSE;
+}
+/*
+  The encode_request function builds the line
+    checksum,time,command[,data]
+  for [command] with [data] and the checksum [kind] straight into the body
+  of [msg] and encodes its headers. The checksum is computed over the pieces
+  before they are copied, so the only allocation is sizing the body.
+  A line longer than the largest v2 body has [data] cut short so that it
+  fits, checksummed as sent, and returns false.
+*/
+bool encode_request(chat_message& msg, boost::string_view command,
+    boost::string_view data, checksum_kind kind = checksum_crc32) {
+  char tm[request_clock::stamp_length];
+  request_clock::stamp(tm);
 
-  std::vector<std::string> args;
-  boost::split(args, input, boost::is_any_of(","));
-  for(unsigned int i = 0; i < args.size(); i++) {
-    if(args[i] == "") {
-      args.erase(args.begin()+i);
-    }
-  }
-  std::string originalCheckSum(args[0]);
-  std::string line = "," + build_line_no_checksum(args, 1);
-  unsigned int chcksm = gen_crc32(line);
-
-  std::stringstream sstream;
-  sstream << std::hex << chcksm << "";
-  generatedCheckSum = sstream.str();
-  if(DEBUG_MODE) {
-    //std::cout << line << std::endl;
-    //std::cout << originalCheckSum << std::endl;
-    //std::cout << generatedCheckSum << std::endl;
-  }
-  if((originalCheckSum.compare(generatedCheckSum)) == 0)
-  {
-    return TRUE;
+  // the checksum takes at most 8 hex digits, and there are three commas
+  const std::size_t max_length = chat_message::max_v2_body_length;
+  const std::size_t fixed = 8 + 1 + sizeof(tm) + 1 + 1;
+  command = command.substr(0, max_length - fixed);
+  std::size_t room = max_length - fixed - command.size();
+  bool fits = data.size() <= room;
+  data = data.substr(0, room);
+
+  static const char comma = ',';
+  static const char terminator = '\0';
+  unsigned int crc = update_checksum(0, &comma, 1, kind);
+  crc = update_checksum(crc, tm, sizeof(tm), kind);
+  crc = update_checksum(crc, &comma, 1, kind);
+  crc = update_checksum(crc, command.data(), command.size(), kind);
+  if(!data.empty()) {
+    crc = update_checksum(crc, &comma, 1, kind);
+    crc = update_checksum(crc, data.data(), data.size(), kind);
   }
-  else
-  {
-    return FALSE;
+  crc = update_checksum(crc, &terminator, 1, kind);
+
+  // the checksum is lowercase hex without leading zeros
+  char hex[8];
+  std::size_t digits = 0;
+  do {
+    hex[7 - digits] = "0123456789abcdef"[(crc >> (4 * digits)) & 0xf];
+    digits++;
+  } while(digits < 8 && (crc >> (4 * digits)) != 0);
+
+  std::size_t length = digits + 1 + sizeof(tm) + 1 + command.size()
+    + (data.empty() ? 0 : 1 + data.size());
+  // at most max_length by the cuts above, so body_length keeps all of it
+  // and the copies below stay inside the body
+  msg.body_length(length);
+  char* p = msg.body();
+  std::memcpy(p, hex + 8 - digits, digits);
+  p += digits;
+  *p++ = ',';
+  std::memcpy(p, tm, sizeof(tm));
+  p += sizeof(tm);
+  *p++ = ',';
+  std::memcpy(p, command.data(), command.size());
+  p += command.size();
+  if(!data.empty()) {
+    *p++ = ',';
+    std::memcpy(p, data.data(), data.size());
   }
+  msg.encode_header();
+  return fits;
+}
+
+/*
+  The make_request_message function does the same as encode_request but
+  returns the frame as a chat_message_ptr so it can be queued on many
+  sessions.
+*/
+chat_message_ptr make_request_message(boost::string_view command,
+    boost::string_view data, checksum_kind kind = checksum_crc32) {
+  std::shared_ptr<chat_message> msg = std::make_shared<chat_message>();
+  encode_request(*msg, command, data, kind);
+  return msg;
 }
+
 /*
   The format_request function takes a string [command] and another string [data]
   as parameters and builds a message to be sent by either the server or the client
-  in the format specified by the requirements document.
+  in the format specified by the requirements document, with the checksum
+  [kind] the connection uses.
   Returns a string [req]
 */
-std::string format_request(std::string command, std::string data) {
-  std::string tm = boost::posix_time::to_iso_string(boost::posix_time::microsec_clock::local_time());
-  char cmd[chat_message::max_body_length + 1];
-  char req[chat_message::max_body_length + 1];
-
-  std::string build = "," + tm + "," + command;
-  if(data != "") {
-    build += "," + data;
-  }
-  strcpy(cmd, build.c_str());
-  unsigned int chcksm = gen_crc32(std::string(build));
-
-  std::stringstream sstream;
-  sstream << std::hex << chcksm << "";
-  std::string result = sstream.str();
+std::string format_request(std::string command, std::string data,
+    checksum_kind kind = checksum_crc32) {
+  chat_message msg;
+  encode_request(msg, command, data, kind);
+  return std::string(msg.body(), msg.body_length());
+}
 
-  strcpy(req, result.c_str());
-  strcat(req, cmd);
+/*
+  The make_message function takes a formatted line [line], usually the result
+  of format_request, and copies it into the body of a chat_message with the
+  header already encoded so it can be written straight to a socket.
+*/
+chat_message make_message(const std::string& line) {
+  chat_message msg;
+  msg.body_length(line.length());
+  std::memcpy(msg.body(), line.c_str(), msg.body_length());
+  msg.encode_header();
+  return msg;
+}
 
-  return std::string(req);
+/*
+  The make_shared_message function does the same as make_message but returns
+  the frame as a chat_message_ptr so it can be queued on many sessions.
+*/
+chat_message_ptr make_shared_message(const std::string& line) {
+  std::shared_ptr<chat_message> msg = std::make_shared<chat_message>();
+  msg->body_length(line.length());
+  std::memcpy(msg->body(), line.c_str(), msg->body_length());
+  msg->encode_header();
+  return msg;
 }
 
 /*
@@ -174,13 +459,12 @@ std::string format_request(std::string command, std::string data) {
   Returns a string [req]
 */
 std::string format_request_nochecksum(std::string tm, std::string command, std::string data) {
-  char cmd[chat_message::max_body_length + 1];
-
   std::string build = "," + tm + "," + command;
   if(data != "") {
     build += "," + data;
   }
-  strcpy(cmd, build.c_str());
 
-  return std::string(cmd);
+  return build;
 }
+
+#endif // UTIL_HPP